@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2017 Martin Paljak
+ */
+
+#pragma once
+
+#include <QByteArray>
+#include <QtEndian>
+
+#include <cstring>
+
+/*
+Binary WebSocket frames for APDU traffic, an alternative to SCardTransmit
+messages with base64 in JSON. Control messages (SCardConnect etc) remain JSON,
+the reply to SCardConnect carries the "index" of the reader to use in frames.
+
+All frames have an 8 byte header, followed by the payload:
+
+  0     version, 0x01
+  1     command
+  2     reader index, as returned by SCardConnect
+  3     flags
+  4..7  message id, big endian
+
+Transmit (0x01) carries the command APDU and is answered with a frame with the
+same id and the response APDU. If the Error flag (0x01) is set in the reply,
+the payload is the error name in ASCII, as "error" in JSON. Frame ids have a
+namespace of their own: frame id 7 is known as "frame:7" to JSON commands like
+cancel, and JSON requests can not use such ids. A frame with an id that is
+still in use is answered with an error frame.
+*/
+namespace ApduFrame {
+    static const quint8 version = 0x01;
+    static const int headerSize = 8;
+
+    enum Command: quint8 {
+        Transmit = 0x01
+    };
+
+    enum Flags: quint8 {
+        Error = 0x01
+    };
+
+    struct Header {
+        quint8 command = Transmit;
+        quint8 reader = 0;
+        quint8 flags = 0;
+        quint32 id = 0;
+    };
+
+    // Returns false if the frame is too short or of unknown version
+    inline bool decode(const QByteArray &frame, Header &header, QByteArray &payload) {
+        if (frame.size() < headerSize || quint8(frame.at(0)) != version) {
+            return false;
+        }
+        const uchar *p = reinterpret_cast<const uchar *>(frame.constData());
+        header.command = p[1];
+        header.reader = p[2];
+        header.flags = p[3];
+        header.id = qFromBigEndian<quint32>(p + 4);
+        payload = frame.mid(headerSize);
+        return true;
+    }
+
+    inline QByteArray encode(const Header &header, const QByteArray &payload) {
+        QByteArray frame(headerSize + payload.size(), Qt::Uninitialized);
+        uchar *p = reinterpret_cast<uchar *>(frame.data());
+        p[0] = version;
+        p[1] = header.command;
+        p[2] = header.reader;
+        p[3] = header.flags;
+        qToBigEndian<quint32>(header.id, p + 4);
+        memcpy(p + headerSize, payload.constData(), payload.size());
+        return frame;
+    }
+}
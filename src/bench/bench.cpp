@@ -0,0 +1,210 @@
+/*
+ * Copyright (C) 2017 Martin Paljak
+ */
+
+// Microbenchmarks for the message path between the browser and the app.
+// Not part of the package, built with qmake CONFIG+=bench and run with an
+// optional iteration count:
+// web-eid-bench [iterations]
+
+#include "apduframe.h"
+#include "cbor.h"
+
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QVariantMap>
+
+#include <functional>
+#include <stdio.h>
+
+// Heap allocations, counted where malloc can be interposed (glibc)
+static long allocations = 0;
+#ifdef __GLIBC__
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *p, size_t size);
+
+void *malloc(size_t size) {
+    allocations++;
+    return __libc_malloc(size);
+}
+void *calloc(size_t n, size_t size) {
+    allocations++;
+    return __libc_calloc(n, size);
+}
+void *realloc(void *p, size_t size) {
+    allocations++;
+    return __libc_realloc(p, size);
+}
+}
+#endif
+
+// Runs fn n times, prints the time, heap allocations and wire size per call
+static void measure(const char *name, int n, std::function<int()> fn) {
+    int bytes = 0;
+    long before = allocations;
+    QElapsedTimer timer;
+    timer.start();
+    for (int i = 0; i < n; i++) {
+        bytes = fn();
+    }
+    qint64 ns = timer.nsecsElapsed();
+    printf("%-32s %8.0f ns/op %6.1f allocs/op %6d bytes/op\n", name, double(ns) / n, double(allocations - before) / n, bytes);
+}
+
+static const QByteArray message = "{\"id\":\"42\",\"origin\":\"https://example.com\",\"SCardTransmit\":"
+                                  "{\"reader\":\"ACS ACR38U-CCID 00 00\",\"bytes\":\"AKQEDAygAAAAdwEIAAcAAP4AAAEA\"}}";
+
+// Incoming message as it was handled: variant map, rendered again for the log
+static int incomingVariant() {
+    QVariantMap json = QJsonDocument::fromJson(message).toVariant().toMap();
+    QByteArray logged = QJsonDocument::fromVariant(json).toJson();
+    Q_UNUSED(logged);
+    return json.value("SCardTransmit").toMap().value("bytes").toString().size();
+}
+
+// Incoming message as a JSON object, the raw bytes are logged
+static int incomingObject() {
+    QJsonObject json = QJsonDocument::fromJson(message).object();
+    return json.value("SCardTransmit").toObject().value("bytes").toString().size();
+}
+
+// Reply as it was built: variant map, serialized compact and indented
+static int outgoingVariant() {
+    QVariantMap reply = {{"bytes", QByteArray(258, char(0x30)).toBase64()}};
+    reply["id"] = "42";
+    QByteArray response = QJsonDocument::fromVariant(reply).toJson(QJsonDocument::Compact);
+    QByteArray logged = QJsonDocument::fromVariant(reply).toJson();
+    Q_UNUSED(logged);
+    return response.size();
+}
+
+// Reply as a JSON object, serialized once
+static int outgoingObject() {
+    QJsonObject reply = {{"bytes", QString(QByteArray(258, char(0x30)).toBase64())}};
+    reply["id"] = "42";
+    return QJsonDocument(reply).toJson(QJsonDocument::Compact).size();
+}
+
+// One SCardTransmit and its reply as JSON text frames, both ways
+static int transmitJSON(const QByteArray &apdu, const QByteArray &response) {
+    QVariantMap request = {{"id", "42"}, {"SCardTransmit", QVariantMap{{"reader", "Reader 0"}, {"bytes", apdu.toBase64()}}}};
+    QString out = QString(QJsonDocument::fromVariant(request).toJson(QJsonDocument::Compact));
+    QVariantMap in = QJsonDocument::fromJson(out.toUtf8()).toVariant().toMap();
+    QByteArray command = QByteArray::fromBase64(in.value("SCardTransmit").toMap().value("bytes").toString().toLatin1());
+
+    QVariantMap reply = {{"id", in.value("id")}, {"bytes", response.toBase64()}};
+    QString back = QString(QJsonDocument::fromVariant(reply).toJson(QJsonDocument::Compact));
+    QVariantMap result = QJsonDocument::fromJson(back.toUtf8()).toVariant().toMap();
+    QByteArray bytes = QByteArray::fromBase64(result.value("bytes").toString().toLatin1());
+    return command.size() == apdu.size() && bytes.size() == response.size() ? out.toUtf8().size() + back.toUtf8().size() : -1;
+}
+
+// The same with binary frames
+static int transmitFrame(const QByteArray &apdu, const QByteArray &response) {
+    ApduFrame::Header header;
+    header.id = 42;
+    QByteArray out = ApduFrame::encode(header, apdu);
+    ApduFrame::Header in;
+    QByteArray command;
+    ApduFrame::decode(out, in, command);
+
+    QByteArray back = ApduFrame::encode(in, response);
+    ApduFrame::Header result;
+    QByteArray bytes;
+    ApduFrame::decode(back, result, bytes);
+    return command.size() == apdu.size() && bytes.size() == response.size() ? out.size() + back.size() : -1;
+}
+
+// A reply encoded and decoded again as JSON
+static int roundtripJSON(const QJsonObject &reply) {
+    QByteArray wire = QJsonDocument(reply).toJson(QJsonDocument::Compact);
+    QJsonObject back = QJsonDocument::fromJson(wire).object();
+    return back.size() == reply.size() ? wire.size() : -1;
+}
+
+// The same as CBOR
+static int roundtripCBOR(const QJsonObject &reply) {
+    QByteArray wire = Cbor::encode(reply);
+    QJsonObject back = Cbor::decode(wire);
+    return back.size() == reply.size() ? wire.size() : -1;
+}
+
+// A SCardTransmit from the browser to the app and its reply back, handled as
+// in NMBridge::toApp(), Transport::parse() and WebContext on the way in and
+// in Transport::send() and the bridge on the way out
+static int bridgeTransmit(bool cbor, const QByteArray &request, const QByteArray &apdu, const QByteArray &response) {
+    // Bridge: the browser sends JSON, "browser" is added
+    QJsonObject message = QJsonDocument::fromJson(request).object();
+    message["browser"] = QStringLiteral("chrome");
+    QByteArray wire = cbor ? Cbor::encode(message) : QJsonDocument(message).toJson(QJsonDocument::Compact);
+    // App: the message is parsed, the APDU comes raw with CBOR and from base64 with JSON
+    QByteArray command;
+    QJsonObject json = cbor ? Cbor::decode(wire, &command) : QJsonDocument::fromJson(wire).object();
+    if (!cbor) {
+        command = QByteArray::fromBase64(json.value("SCardTransmit").toObject().value("bytes").toString().toLatin1());
+    }
+
+    // App: the response is raw with CBOR and base64 with JSON
+    QJsonObject reply = {{"id", json.value("id")}};
+    if (!cbor) {
+        reply["bytes"] = QString(response.toBase64());
+    }
+    QByteArray back = cbor ? Cbor::encode(reply, response) : QJsonDocument(reply).toJson(QJsonDocument::Compact);
+    // Bridge: the browser gets JSON
+    QByteArray browser = cbor ? QJsonDocument(Cbor::decode(back)).toJson(QJsonDocument::Compact) : back;
+    return command.size() == apdu.size() && !browser.isEmpty() ? wire.size() + back.size() : -1;
+}
+
+int main(int argc, char *argv[]) {
+    QCoreApplication app(argc, argv);
+    int n = argc > 1 ? atoi(argv[1]) : 100000;
+
+    // SELECT and a short response, READ BINARY of a full short APDU
+    const QByteArray select = QByteArray::fromHex("00A4040C0CA000000077010800070000FE00000100");
+    const QByteArray ok = QByteArray::fromHex("9000");
+    const QByteArray read = QByteArray::fromHex("00B0000000");
+    const QByteArray data = QByteArray(256, char(0x30)) + ok;
+
+    measure("transmit select json", n, [&] { return transmitJSON(select, ok); });
+    measure("transmit select frame", n, [&] { return transmitFrame(select, ok); });
+    measure("transmit read json", n, [&] { return transmitJSON(read, data); });
+    measure("transmit read frame", n, [&] { return transmitFrame(read, data); });
+
+    auto request = [] (const QByteArray &apdu) {
+        return QJsonDocument(QJsonObject{{"id", "42"}, {"origin", "https://example.com"},
+            {"SCardTransmit", QJsonObject{{"reader", "Reader 0"}, {"bytes", QString(apdu.toBase64())}}}}).toJson(QJsonDocument::Compact);
+    };
+    const QByteArray selectRequest = request(select);
+    const QByteArray readRequest = request(read);
+    measure("bridge select json", n, [&] { return bridgeTransmit(false, selectRequest, select, ok); });
+    measure("bridge read json", n, [&] { return bridgeTransmit(false, readRequest, read, data); });
+    if (Cbor::isSupported()) {
+        measure("bridge select cbor", n, [&] { return bridgeTransmit(true, selectRequest, select, ok); });
+        measure("bridge read cbor", n, [&] { return bridgeTransmit(true, readRequest, read, data); });
+    }
+
+    measure("incoming variant", n, incomingVariant);
+    measure("incoming object", n, incomingObject);
+    measure("outgoing variant", n, outgoingVariant);
+    measure("outgoing object", n, outgoingObject);
+
+    if (Cbor::isSupported()) {
+        const QJsonObject response = {{"id", "42"}, {"bytes", QString(data.toBase64())}};
+        QByteArray der(1400, Qt::Uninitialized);
+        for (int i = 0; i < der.size(); i++) {
+            der[i] = char(i * 7);
+        }
+        const QJsonObject certificate = {{"id", "43"}, {"certificate", QString(der.toBase64())}};
+        measure("reply bytes json", n, [&] { return roundtripJSON(response); });
+        measure("reply bytes cbor", n, [&] { return roundtripCBOR(response); });
+        measure("reply certificate json", n, [&] { return roundtripJSON(certificate); });
+        measure("reply certificate cbor", n, [&] { return roundtripCBOR(certificate); });
+    } else {
+        printf("CBOR needs Qt 5.12, skipped\n");
+    }
+    return 0;
+}
@@ -0,0 +1,9 @@
+OBJECTS_DIR = build
+MOC_DIR = build
+TEMPLATE = app
+CONFIG += console c++11
+CONFIG -= app_bundle
+QT -= gui
+INCLUDEPATH += ..
+TARGET = web-eid-bench
+SOURCES += bench.cpp ../cbor.cpp
@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2017 Martin Paljak
+ */
+
+#include "capture.h"
+
+#include "debuglog.h"
+#include "apduframe.h"
+#include "pcscrecorder.h"
+
+#include <QDateTime>
+#include <QDir>
+#include <QJsonDocument>
+#include <QRegExp>
+#include <QSettings>
+#include <QStandardPaths>
+
+static QByteArray mask(const QByteArray &apdu) {
+    if (!PCSCRecorder::isPINCommand(apdu)) {
+        return apdu;
+    }
+    return apdu.left(5) + QByteArray(apdu.size() - 5, char(0xFF));
+}
+
+QString ProtocolCapture::getCapturePath() {
+    return QDir(QStandardPaths::writableLocation(QStandardPaths::DesktopLocation)).filePath("web-eid-captures");
+}
+
+ProtocolCapture *ProtocolCapture::start(const QString &transport, const QString &origin) {
+    QSettings settings;
+    if (!settings.value("capture", false).toBool()) {
+        return nullptr;
+    }
+    QDir dir(getCapturePath());
+    if (!dir.mkpath(".")) {
+        _log("Could not create %s", qPrintable(dir.path()));
+        return nullptr;
+    }
+    QString name = origin.isEmpty() ? transport : origin;
+    name.replace(QRegExp("[^A-Za-z0-9_-]+"), "_");
+    ProtocolCapture *capture = new ProtocolCapture();
+    capture->file.setFileName(dir.filePath(QStringLiteral("%1-%2.jsonl").arg(QDateTime::currentDateTime().toString("yyyyMMdd-hhmmsszzz"), name)));
+    if (!capture->file.open(QIODevice::WriteOnly)) {
+        _log("Could not write %s", qPrintable(capture->file.fileName()));
+        delete capture;
+        return nullptr;
+    }
+    _log("Capturing traffic of %s to %s", qPrintable(name), qPrintable(capture->file.fileName()));
+    QJsonObject header = {{"transport", transport}, {"captured", QDateTime::currentDateTime().toString(Qt::ISODate)}};
+    if (!origin.isEmpty()) {
+        header["origin"] = origin;
+    }
+    capture->file.write(QJsonDocument(header).toJson(QJsonDocument::Compact) + "\n");
+    capture->clock.start();
+    return capture;
+}
+
+void ProtocolCapture::message(bool incoming, const QJsonObject &message) {
+    if (incoming && message.contains("SCardTransmit")) {
+        QJsonObject masked = message;
+        QJsonObject params = masked.value("SCardTransmit").toObject();
+        QByteArray apdu = QByteArray::fromBase64(params.value("bytes").toString().toLatin1());
+        params["bytes"] = QString(mask(apdu).toBase64());
+        masked["SCardTransmit"] = params;
+        return write(incoming, masked);
+    }
+    write(incoming, message);
+}
+
+void ProtocolCapture::frame(bool incoming, const QByteArray &frame) {
+    if (incoming && frame.size() > ApduFrame::headerSize) {
+        return write(incoming, QString((frame.left(ApduFrame::headerSize) + mask(frame.mid(ApduFrame::headerSize))).toBase64()));
+    }
+    write(incoming, QString(frame.toBase64()));
+}
+
+void ProtocolCapture::write(bool incoming, const QJsonValue &value) {
+    QJsonObject line = {{"ms", clock.elapsed()}, {incoming ? "in" : "out", value}};
+    file.write(QJsonDocument(line).toJson(QJsonDocument::Compact) + "\n");
+    file.flush();
+}
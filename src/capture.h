@@ -0,0 +1,45 @@
+/*
+ * Copyright (C) 2017 Martin Paljak
+ */
+
+#pragma once
+
+#include <QByteArray>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QJsonObject>
+#include <QString>
+
+/*
+Captures the protocol traffic of a connection for replaying with
+tests/replay.py. Enabled with the "capture" setting. Every connection is
+written to a JSON Lines file in the web-eid-captures folder on the desktop,
+named by the time and origin. The first line describes the connection, the
+rest are messages as they were received or sent, with the milliseconds since
+the connection was opened:
+
+{"origin": "https://example.com", "transport": "websocket", "captured": "2017-..."}
+{"ms": 12, "in": {"id": "1", "origin": "https://example.com", "SCardConnect": {...}}}
+{"ms": 870, "out": {"id": "1", "name": "...", "atr": "..."}}
+{"ms": 875, "in": "AQEAAAAAAAIApAQM..."}
+
+Binary frames are base64 strings. The APDU-s of PIN commands are masked with
+FF bytes, as in PC/SC recordings.
+*/
+class ProtocolCapture {
+public:
+    // Returns nullptr if capturing is not enabled
+    static ProtocolCapture *start(const QString &transport, const QString &origin);
+
+    void message(bool incoming, const QJsonObject &message);
+    void frame(bool incoming, const QByteArray &frame);
+
+    static QString getCapturePath();
+
+private:
+    ProtocolCapture() {};
+    void write(bool incoming, const QJsonValue &value);
+
+    QFile file;
+    QElapsedTimer clock;
+};
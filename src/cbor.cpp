@@ -0,0 +1,114 @@
+/*
+ * Copyright (C) 2017 Martin Paljak
+ */
+
+#include "cbor.h"
+
+#include <QJsonArray>
+#include <QStringList>
+
+#if QT_VERSION >= QT_VERSION_CHECK(5, 12, 0)
+#include <QCborArray>
+#include <QCborMap>
+#include <QCborValue>
+
+// Fields that carry base64 in JSON
+static const QStringList binary = {"bytes", "atr", "atrs", "certificate", "hash", "signature"};
+
+static QCborMap toCbor(const QJsonObject &object);
+
+static QCborValue toCbor(const QString &key, const QJsonValue &value) {
+    if (value.isObject()) {
+        return toCbor(value.toObject());
+    } else if (value.isArray()) {
+        QCborArray result;
+        for (const auto &v: value.toArray()) {
+            result.append(toCbor(key, v));
+        }
+        return result;
+    } else if (value.isString() && binary.contains(key)) {
+        // Anything but canonical base64 stays a string
+        const QByteArray text = value.toString().toLatin1();
+        const QByteArray bytes = QByteArray::fromBase64(text);
+        if (bytes.toBase64() == text) {
+            return bytes;
+        }
+    }
+    return QCborValue::fromJsonValue(value);
+}
+
+static QCborMap toCbor(const QJsonObject &object) {
+    QCborMap result;
+    for (auto i = object.constBegin(); i != object.constEnd(); ++i) {
+        result.insert(i.key(), toCbor(i.key(), i.value()));
+    }
+    return result;
+}
+
+static QJsonValue toJson(const QCborValue &value) {
+    if (value.isMap()) {
+        QJsonObject result;
+        const QCborMap map = value.toMap();
+        for (auto i = map.constBegin(); i != map.constEnd(); ++i) {
+            result.insert(i.key().toString(), toJson(i.value()));
+        }
+        return result;
+    } else if (value.isArray()) {
+        QJsonArray result;
+        for (const auto &v: value.toArray()) {
+            result.append(toJson(v));
+        }
+        return result;
+    } else if (value.isByteArray()) {
+        return QString(value.toByteArray().toBase64());
+    }
+    return value.toJsonValue();
+}
+
+bool Cbor::isSupported() {
+    return true;
+}
+
+QByteArray Cbor::encode(const QJsonObject &message, const QByteArray &bytes) {
+    QCborMap map = toCbor(message);
+    if (!bytes.isEmpty()) {
+        map.insert(QStringLiteral("bytes"), bytes);
+    }
+    return QCborValue(map).toCbor();
+}
+
+QJsonObject Cbor::decode(const QByteArray &message, QByteArray *apdu) {
+    QCborValue value = QCborValue::fromCbor(message);
+    if (!value.isMap()) {
+        return QJsonObject();
+    }
+    QCborMap map = value.toMap();
+    const QCborValue transmit = map.value(QStringLiteral("SCardTransmit"));
+    if (apdu && transmit.isMap() && transmit.toMap().value(QStringLiteral("bytes")).isByteArray()) {
+        QCborMap params = transmit.toMap();
+        *apdu = params.take(QStringLiteral("bytes")).toByteArray();
+        map.insert(QStringLiteral("SCardTransmit"), params);
+    }
+    return toJson(map).toObject();
+}
+#else
+bool Cbor::isSupported() {
+    return false;
+}
+
+QByteArray Cbor::encode(const QJsonObject &message, const QByteArray &bytes) {
+    Q_UNUSED(message);
+    Q_UNUSED(bytes);
+    return QByteArray();
+}
+
+QJsonObject Cbor::decode(const QByteArray &message, QByteArray *apdu) {
+    Q_UNUSED(message);
+    Q_UNUSED(apdu);
+    return QJsonObject();
+}
+#endif
+
+bool Cbor::isCbor(const QByteArray &message) {
+    return !message.isEmpty() && (quint8(message.at(0)) & 0xE0) == 0xA0;
+}
@@ -0,0 +1,39 @@
+/*
+ * Copyright (C) 2017 Martin Paljak
+ */
+
+#pragma once
+
+#include <QByteArray>
+#include <QJsonObject>
+
+/*
+CBOR (RFC 7049) encoding of messages, an alternative to JSON on the local
+socket and WebSocket. Peers offer it with
+
+  {"internal": "hello", "encodings": ["cbor"]}
+
+and get {"internal": "hello", "encoding": "cbor"} back if it is available
+(needs Qt 5.12) and not turned off with the "cbor" setting. Only after that
+may either side send CBOR. Messages are told apart by the first byte: '{' for
+JSON, a map (0xA0..0xBF) for CBOR, and are answered in the encoding of the
+last message received.
+
+Messages are the same as in JSON, except that binary fields (APDU-s, ATR-s,
+certificates, hashes and signatures) are byte strings instead of base64. A
+string becomes a byte string only if it is canonical base64, so that any
+other string survives the round trip. The APDU of SCardTransmit and the
+"bytes" of replies are passed raw next to the message inside the app, so
+that APDU-s need no base64 at all. Other binary fields are base64 inside the
+app, as with JSON.
+*/
+namespace Cbor {
+    bool isSupported();
+    bool isCbor(const QByteArray &message);
+
+    // bytes, if any, go raw to the "bytes" field
+    QByteArray encode(const QJsonObject &message, const QByteArray &bytes = QByteArray());
+    // Returns an empty object if message is not a CBOR map. With apdu, the
+    // "bytes" of SCardTransmit are taken out of the message into it
+    QJsonObject decode(const QByteArray &message, QByteArray *apdu = nullptr);
+}
@@ -5,114 +5,148 @@
 #include "context.h"
 
 #include "debuglog.h"
+#include "apduframe.h"
+#include "transport.h"
+#include <QJsonArray>
 #include <QJsonObject>
 #include <QJsonDocument>
+#include <QSettings>
 #include <QtConcurrent>
 
 #include "main.h" // for parent
 
 #include "dialogs/select_reader.h"
 
-WebContext::WebContext(QObject *parent, QLocalSocket *client): QObject(parent)  {
-    this->ls = client;
-    connect(client, &QLocalSocket::readyRead, this, [this, client] {
-        _log("Handling data from local socket");
-        _log("Available: %d", client->bytesAvailable());
-        quint32 msgsize = 0;
-        if (client->bytesAvailable() < qint64(sizeof(msgsize) + 1)) {
-            return;
+WebContext::WebContext(QObject *parent, Transport *transport): QObject(parent), local(transport->local) {
+    origin = transport->origin;
+    // Queued, the transport is in the I/O thread
+    connect(transport, &Transport::received, this, [this] (const QJsonObject &message, const QByteArray &apdu) {
+        const QString id = message.value("id").toString();
+        // Binary frames have ids of their own, that JSON requests can not take
+        if (id.startsWith(QStringLiteral("frame:"))) {
+            return outgoing({{"id", id}, {"error", "protocol"}});
         }
-        if (client->read((char*)&msgsize, sizeof(msgsize)) == sizeof(msgsize)) {
-            _log("Read message size: %d bytes", msgsize);
-            QByteArray msg(int(msgsize), 0);
-            quint64 numread = client->read(msg.data(), msgsize);
-            if (numread == msgsize) {
-                _log("Read message of %d bytes", msgsize);
-                // Make JSON
-                QVariantMap json = QJsonDocument::fromJson(msg).toVariant().toMap();
-
-                // re-serialize msg
-                QByteArray response =  QJsonDocument::fromVariant(json).toJson();
-                _log("Read message:\n%s", response.constData());
-
-                // Handle internal messages
-                if (json.contains("internal")) {
-                    if (json["internal"] == "quit") {
-                        return QApplication::quit();
-                    }
-                }
-                // Check for mandatory fields
-                if (!json.contains("origin") || !json.contains("id")) {
-                    _log("No id or origin, terminating");
-                    terminate();
-                }
-
-                // Check origin
-                if (origin.isEmpty()) {
-                    origin = json.value("origin").toString();
-                } else {
-                    if (origin != json.value("origin").toString()) {
-                        _log("Origin mismatch, terminating");
-                        terminate();
-                    }
-                }
-                processMessage(json);
-            } else {
-                _log("Could not read message, read %d of %d", numread, msgsize);
-                terminate();
+        // A raw APDU waits for its request, as for frames
+        if (!apdu.isEmpty()) {
+            if (inflight.contains(id) || raw.contains(id)) {
+                _log("Message id %s is already in use", qPrintable(id));
+                return outgoing({{"id", id}, {"error", "protocol"}});
             }
-        } else {
-            _log("Could not read message size");
-            terminate();
+            raw[id] = apdu;
         }
+        admit(message);
     });
-    connect(client, &QLocalSocket::disconnected, this, [this, client] {
-        _log("Local client disconnected (%s)", qPrintable(this->origin));
+    connect(transport, &Transport::frameReceived, this, &WebContext::frameReceived);
+    connect(transport, &Transport::disconnected, this, [this] {
+        forget();
         emit disconnected();
     });
+    connect(this, &WebContext::sending, transport, &Transport::send);
+    connect(this, &WebContext::sendingFrame, transport, &Transport::sendFrame);
+    connect(this, &WebContext::pausing, transport, &Transport::setPaused);
+    connect(this, &WebContext::terminating, transport, &Transport::terminate);
+    QMetaObject::invokeMethod(transport, "start", Qt::QueuedConnection);
+
     // Save references to PKI and PCSC
     PCSC = &((QtHost *)parent)->PCSC;
     PKI = &((QtHost *)parent)->PKI;
+    limiter = &((QtHost *)parent)->limiter;
+    QSettings settings;
+    window = settings.value("maxPending", 16).toInt();
 }
 
-WebContext::WebContext(QObject *parent, QWebSocket *client): QObject(parent) {
-    this->ws = client;
-    this->origin = client->origin();
-    connect(client, &QWebSocket::textMessageReceived, this, [this, client] (QString message) {
-        _log("Message received from %s", qPrintable(origin));
-        QVariantMap json = QJsonDocument::fromJson(message.toUtf8()).toVariant().toMap();
-        if (!json.contains("id")) {
-            _log("No id, terminating");
-            terminate();
-        }
-        // re-serialize msg
-        QByteArray response =  QJsonDocument::fromVariant(json).toJson();
-        _log("Read message: %s", response.constData());
+// The client is gone, its requests are not answered any more
+void WebContext::forget() {
+    limiter->release(origin, inflight.size());
+    inflight.clear();
+    backlog.clear();
+    frames.clear();
+    raw.clear();
+}
 
-        // Add origin for uniform message processing
-        json["origin"] = origin;
-        processMessage(json);
-    });
-    connect(client, &QWebSocket::disconnected, this, [this, client] {
-        _log("%s disconnected", qPrintable(client->origin()));
-        emit disconnected();
-    });
+// Same as SCardTransmit, but the APDU-s stay raw and the reply is a frame
+void WebContext::frameReceived(quint32 frame, quint8 reader, const QByteArray &apdu) {
+    const QString id = QStringLiteral("frame:%1").arg(frame);
+    if (inflight.contains(id)) {
+        _log("Frame id %u is already in use", frame);
+        return emit sendingFrame(frame, reader, ApduFrame::Error, "protocol");
+    }
+    frames[id] = {frame, reader, apdu};
+    admit({{"id", id}, {"origin", origin},
+        {"SCardTransmit", QJsonObject{{"reader", indexes.value(reader)}}}});
+}
 
-    // Save references to PKI and PCSC
-    PCSC = &((QtHost *)parent)->PCSC;
-    PKI = &((QtHost *)parent)->PKI;
+// Messages that do not fit the window wait in the backlog. The local socket
+// is paused, but WebSocket messages can not be left unread, so their backlog
+// is bounded
+void WebContext::admit(const QJsonObject &message) {
+    if (!saturated() && backlog.isEmpty()) {
+        return processMessage(message);
+    }
+    if (!local && backlog.size() >= window) {
+        limiter->throttled(origin, "backlog full");
+        return refuse(message.value("id").toString(), "throttled");
+    }
+    backlog.append(message);
+    if (!paused) {
+        paused = true;
+        emit pausing(true);
+    }
+}
+
+// Continue with messages that were held back
+void WebContext::resume() {
+    while (!saturated() && !backlog.isEmpty()) {
+        processMessage(backlog.takeFirst());
+    }
+    if (backlog.isEmpty()) {
+        paused = false;
+        emit pausing(false);
+    }
+}
+
+// Answer a message that is not taken on as a request
+void WebContext::refuse(const QString &id, const QString &error) {
+    // Not the APDU of a running request with the same id
+    if (!inflight.contains(id)) {
+        raw.remove(id);
+    }
+    if (frames.contains(id)) {
+        const Frame f = frames.take(id);
+        emit sendingFrame(f.id, f.reader, ApduFrame::Error, error.toLatin1());
+    } else {
+        outgoing({{"id", id}, {"error", error}});
+    }
+}
+
+// Requests that use the same resource are processed one by one, in the order
+// of arrival. Requests for different resources run concurrently and are
+// answered as they complete, so replies are matched to requests by id.
+static QString resourceOf(const QJsonObject &message) {
+    if (message.contains("SCardConnect")) {
+        return QStringLiteral("connect");
+    }
+    for (const auto &command: {"SCardDisconnect", "SCardTransmit", "SCardReconnect"}) {
+        if (message.contains(command)) {
+            return QStringLiteral("reader:") + message.value(command).toObject().value("reader").toString();
+        }
+    }
+    if (message.contains("sign") || message.contains("certificate") || message.contains("authenticate")) {
+        return QStringLiteral("pki");
+    }
+    return QString(); // version and unknown commands are answered immediately
 }
 
-// Process a message from a browsing context, one by one
-void WebContext::processMessage(const QVariantMap &message) {
+// Process a message from a browsing context
+void WebContext::processMessage(const QJsonObject &message) {
     _log("Processing message");
-    QVariantMap resp;
 
-    // Current message ID
-    if (!msgid.isEmpty()) {
-        return outgoing({{"error", "protocol"}});
+    // Message ID-s must be unique among requests of the context that are not answered yet
+    const QString id = message.value("id").toString();
+    if (inflight.contains(id)) {
+        _log("Message id %s is already in use", qPrintable(id));
+        return refuse(id, "protocol");
     }
-    msgid = message.value("id").toString();
 
     // Origin. If unset for context, set
     // Check if origin is secure
@@ -142,130 +176,168 @@ void WebContext::processMessage(const QVariantMap &message) {
         }
     */
 
-    timer.setSingleShot(true);
-    timer.start(5000); // 5 seconds
+    if (!limiter->acquire(origin, RateLimiter::kindOf(message))) {
+        return refuse(id, "throttled");
+    }
+    const QString resource = resourceOf(message);
+    inflight[id] = resource;
+    if (!resource.isEmpty() && busy.contains(resource)) {
+        _log("%s is busy with %s, queueing %s", qPrintable(resource), qPrintable(busy.value(resource)), qPrintable(id));
+        queued[resource].append(message);
+        return;
+    }
+    start(message);
+}
+
+void WebContext::start(const QJsonObject &message) {
+    const QString id = message.value("id").toString();
+    const QString resource = inflight.value(id);
+    if (!resource.isEmpty()) {
+        busy[resource] = id;
+    }
+
     // Command dispatch
     if (message.contains("version")) {
-        return outgoing({{"id", msgid}, {"version", VERSION}});
+        return reply(id, {{"version", VERSION}});
+    } else if (message.contains("SCardListReaders")) {
+        if (!isAllowed("listReaders", true))
+            return reply(id, {{"error", QtPCSC::errorName(SCARD_E_NO_ACCESS)}});
+        return reply(id, {{"readers", listReaders()}});
+    } else if (message.contains("listCertificates")) {
+        // Identifies the user, thus not allowed unless configured
+        if (!isAllowed("listCertificates", false))
+            return reply(id, {{"error", QtPCSC::errorName(SCARD_E_NO_ACCESS)}});
+        return reply(id, {{"certificates", listCertificates()}});
+    } else if (message.contains("subscribe")) {
+        if (!isAllowed("subscribe", true))
+            return reply(id, {{"error", QtPCSC::errorName(SCARD_E_NO_ACCESS)}});
+        return reply(id, subscribe(id, message.value("subscribe").toObject()));
+    } else if (message.contains("unsubscribe")) {
+        const QString subscription = message.value("unsubscribe").toObject().value("id").toString();
+        return reply(id, {{"unsubscribed", unsubscribe(subscription)}});
+    } else if (message.contains("cancel")) {
+        const QString target = message.value("cancel").toObject().value("id").toString();
+        return reply(id, {{"cancelled", cancel(target)}});
     } else if (message.contains("SCardConnect")) {
-        auto params = message.value("SCardConnect").toMap();
+        auto params = message.value("SCardConnect").toObject();
         // Show reader selection or confirmation dialog
         // to avoid races for card reader resources
         QList<QByteArray> atrs;
         if (params.contains("atrs")) {
-            for (const auto &a: params.value("atrs").toList()) {
+            for (const auto &a: params.value("atrs").toArray()) {
                 atrs.append(QByteArray::fromBase64(a.toString().toLatin1()));
             }
         }
+        // Skip the dialog if the remembered reader is ready with the expected card
+        if (isAllowed("fastReaderConnect", false)) {
+            QSettings settings;
+            QString remembered = settings.value(friendlyOrigin() + "/reader").toString();
+            auto readers = PCSC->getReaders();
+            if (readers.contains(remembered)) {
+                const auto &reader = readers.value(remembered);
+                if (reader.second.contains("PRESENT") && !reader.second.contains("EXCLUSIVE") && !reader.second.contains("MUTE")
+                        && (atrs.isEmpty() || atrs.contains(reader.first))) {
+                    _log("Connecting to remembered reader %s", qPrintable(remembered));
+                    ((QtHost *)parent())->notify(tr("%1 is using %2").arg(friendlyOrigin(), remembered));
+                    PKI->pause();
+                    return connectReader(id, params, remembered);
+                }
+            }
+        }
         dialog = new QtSelectReader(this, PCSC, atrs); // FIXME
         if (params.contains("timeout")) {
             timer.setSingleShot(true);
-            timer.setInterval(params.value("timeout", 60).toInt() * 1000); // FIXME: define "infinity"
+            timer.setInterval(params.value("timeout").toInt(60) * 1000); // FIXME: define "infinity"
             connect(&timer, &QTimer::timeout, dialog, &QDialog::reject);
+            timer.start();
         }
         PKI->pause();
         ((QtSelectReader *)dialog)->update(PCSC->getReaders());
         connect(dialog, &QDialog::rejected, this, [=] {
             PKI->resume();
-            outgoing({{"error", QtPCSC::errorName(SCARD_E_CANCELLED)}});
+            reply(id, {{"error", QtPCSC::errorName(SCARD_E_CANCELLED)}});
+        });
+        QDialog *d = dialog;
+        connect(this, &WebContext::cancelled, d, [d] (const QString &resource) {
+            if (resource == "connect") {
+                d->reject();
+            }
         });
         // Connect to the reader once the reader name is known
-        connect((QtSelectReader *)dialog, &QtSelectReader::readerSelected, this, [this, params] (QString name) {
-            QPCSCReader *r = PCSC->connectReader(this, name, params.value("protocol", "*").toString(), true);
-            readers[name] = r;
-            connect(r, &QPCSCReader::disconnected, this, [this, name] (LONG err) {
-                _log("Disconnected: %s", QtPCSC::errorName(err));
-                PKI->resume();
-                if (readers.contains(name)) {
-                    QPCSCReader *rd = readers.take(name);
-                    // If disconnect happens in between of messages (eg dialog cancel)
-                    // error will be given on next incoming message
-                    if (!msgid.isEmpty()) {
-                        if (err != SCARD_S_SUCCESS) {
-                            outgoing({{"error", QtPCSC::errorName(err)}});
-                        } else {
-                            outgoing({});
-                        }
-                    } else {
-                        // TODO: store lasterror
-                    }
-                    rd->deleteLater();
-                } else {
-                    // Not yet connected
-                }
-            });
-            connect(r, &QPCSCReader::connected, this, [=] (QByteArray atr, QString proto) {
-                _log("connected: %s %s", qPrintable(proto), qPrintable(atr.toHex()));
-                PKI->resume();
-                outgoing({{"name", name}, {"protocol", proto}, {"atr", atr.toBase64()}});
-            });
-            connect(r, &QPCSCReader::received, this, [=] (QByteArray apdu) {
-                _log("Received apdu");
-                outgoing({{"bytes", apdu.toBase64()}});
-            });
+        connect((QtSelectReader *)dialog, &QtSelectReader::readerSelected, this, [this, params, id] (QString name) {
+            connectReader(id, params, name);
         });
     } else if (message.contains("SCardDisconnect")) {
-        auto params = message.value("SCardDisconnect").toMap();
+        auto params = message.value("SCardDisconnect").toObject();
         if (!params.contains("reader"))
-            return outgoing({{"error", "protocol"}});
+            return reply(id, {{"error", "protocol"}});
         if (!readers.contains(params.value("reader").toString()))
-            return outgoing({{"error", QtPCSC::errorName(SCARD_E_READER_UNAVAILABLE)}});
+            return reply(id, {{"error", QtPCSC::errorName(SCARD_E_READER_UNAVAILABLE)}});
         QPCSCReader *r = readers[params.value("reader").toString()];
         r->disconnect();
     } else if (message.contains("SCardTransmit")) {
-        auto params = message.value("SCardTransmit").toMap();
-        if (!params.contains("reader") || !params.contains("bytes"))
-            return outgoing({{"error", "protocol"}});
+        auto params = message.value("SCardTransmit").toObject();
+        // Frames and CBOR carry the APDU raw
+        QByteArray apdu = frames.contains(id) ? frames[id].apdu : raw.take(id);
+        if (apdu.isEmpty()) {
+            apdu = QByteArray::fromBase64(params.value("bytes").toString().toLatin1());
+        }
+        if (!params.contains("reader") || apdu.isEmpty())
+            return reply(id, {{"error", "protocol"}});
         if (!readers.contains(params.value("reader").toString()))
-            return outgoing({{"error", QtPCSC::errorName(SCARD_E_READER_UNAVAILABLE)}});
+            return reply(id, {{"error", QtPCSC::errorName(SCARD_E_READER_UNAVAILABLE)}});
         QPCSCReader *r = readers[params.value("reader").toString()];
-        r->transmit(QByteArray::fromBase64(params.value("bytes").toString().toLatin1()));
+        r->transmit(apdu);
     } else if (message.contains("SCardReconnect")) {
-        auto params = message.value("SCardReconnect").toMap();
+        auto params = message.value("SCardReconnect").toObject();
         if (!params.contains("reader") || !params.contains("protocol"))
-            return outgoing({{"error", "protocol"}});
+            return reply(id, {{"error", "protocol"}});
         if (!readers.contains(params.value("reader").toString()))
-            return outgoing({{"error", QtPCSC::errorName(SCARD_E_READER_UNAVAILABLE)}});
+            return reply(id, {{"error", QtPCSC::errorName(SCARD_E_READER_UNAVAILABLE)}});
         QPCSCReader *r = readers[params.value("reader").toString()];
         r->reconnect(params.value("protocol").toString());
     } else if (message.contains("sign")) {
-        QVariantMap params = message.value("sign").toMap();
-        if (!params.contains("certificate") || !params.contains("hash"))
-            return outgoing({{"error", "protocol"}});
-        const QByteArray cert = QByteArray::fromBase64(params.value("certificate").toString().toLatin1());
+        QJsonObject params = message.value("sign").toObject();
+        if (!(params.contains("certificate") || params.contains("handle")) || !params.contains("hash"))
+            return reply(id, {{"error", "protocol"}});
+        // The handle of a certificate, as returned with it, or the certificate itself
+        const QByteArray cert = params.contains("handle") ? PKI->findCertificate(params.value("handle").toString())
+                                                          : QByteArray::fromBase64(params.value("certificate").toString().toLatin1());
+        if (cert.isEmpty())
+            return reply(id, {{"error", QPKI::errorName(CKR_OBJECT_HANDLE_INVALID)}});
         const QByteArray hash = QByteArray::fromBase64(params.value("hash").toString().toLatin1());
-        connect(PKI, &QPKI::signature, this, [this] (const WebContext *context, const CK_RV result, const QByteArray &value) {
+        connect(PKI, &QPKI::signature, this, [this, id] (const WebContext *context, const CK_RV result, const QByteArray &value) {
             if (this != context) {
                 _log("Not us, ignore");
                 return;
             }
             disconnect(PKI, &QPKI::signature, this, 0);
             if (result == CKR_OK) {
-                outgoing({{"signature", value.toBase64()}});
+                reply(id, {{"signature", QString(value.toBase64())}});
             } else {
-                outgoing({{"error", QPKI::errorName(result)}});
+                reply(id, {{"error", QPKI::errorName(result)}});
             }
         });
         PKI->sign(this, cert, hash, QStringLiteral("SHA-256"), Signing); // FIXME: signature
     } else if (message.contains("certificate")) {
-        connect(PKI, &QPKI::certificate, this, [this] (const WebContext *context, const CK_RV result, const QByteArray &value) {
+        connect(PKI, &QPKI::certificate, this, [this, id] (const WebContext *context, const CK_RV result, const QByteArray &value) {
             if (this != context) {
                 _log("Not us, ignore");
                 return;
             }
             disconnect(PKI, &QPKI::certificate, this, 0);
             if (result == CKR_OK) {
-                outgoing({{"certificate", value.toBase64()}});
+                reply(id, {{"certificate", QString(value.toBase64())}, {"handle", PKI->getCertificateInfo(value).handle}});
             } else {
-                outgoing({{"error", QPKI::errorName(result)}});
+                reply(id, {{"error", QPKI::errorName(result)}});
             }
         });
         PKI->select(this, Signing);
     } else if (message.contains("authenticate")) {
-        QVariantMap auth = message.value("authenticate").toMap();
+        QJsonObject auth = message.value("authenticate").toObject();
 
         // TODO: Select certificate if needed
-        connect(PKI, &QPKI::certificate, this, [this, auth] (const WebContext *context, const CK_RV result, const QByteArray &value) {
+        connect(PKI, &QPKI::certificate, this, [this, auth, id] (const WebContext *context, const CK_RV result, const QByteArray &value) {
             const QString nonce = auth.value("nonce").toString().toLatin1();
             if (this != context) {
                 _log("Not us, ignore");
@@ -276,7 +348,7 @@ void WebContext::processMessage(const QVariantMap &message) {
                 // We have the certificate
                 QByteArray jwt_token = QPKI::authenticate_dtbs(QSslCertificate(value, QSsl::Der), context->origin, nonce);
                 QByteArray hash = QCryptographicHash::hash(jwt_token, QCryptographicHash::Sha256);
-                connect(PKI, &QPKI::signature, this, [this, jwt_token] (const WebContext* ctx, const CK_RV rv, const QByteArray& val) {
+                connect(PKI, &QPKI::signature, this, [this, jwt_token, id] (const WebContext* ctx, const CK_RV rv, const QByteArray& val) {
                     if (this != ctx) {
                         _log("Not us, ignore");
                         return;
@@ -284,48 +356,326 @@ void WebContext::processMessage(const QVariantMap &message) {
                     disconnect(PKI, &QPKI::signature, this, 0);
                     if (rv == CKR_OK) {
                         QByteArray token = jwt_token + "." + val.toBase64(QByteArray::Base64UrlEncoding | QByteArray::OmitTrailingEquals);
-                        outgoing({{"token", QString(token)}, {"type", "JWT"}});
+                        reply(id, {{"token", QString(token)}, {"type", "JWT"}});
                     } else {
-                        outgoing({{"error", QPKI::errorName(rv)}});
+                        reply(id, {{"error", QPKI::errorName(rv)}});
                     }
                 });
                 PKI->sign(this, value, hash, QStringLiteral("SHA-256"), Authentication);
             } else {
-                outgoing({{"error", QPKI::errorName(result)}});
+                reply(id, {{"error", QPKI::errorName(result)}});
             }
         });
         PKI->select(this, Authentication);
     } else {
-        outgoing({{"error", "protocol"}});
+        reply(id, {{"error", "protocol"}});
+    }
+}
+
+// Connect to the chosen reader and answer the SCardConnect request id
+void WebContext::connectReader(const QString &id, const QJsonObject &params, const QString &name) {
+    if (readers.contains(name)) {
+        PKI->resume();
+        return reply(id, {{"error", QtPCSC::errorName(SCARD_E_SHARING_VIOLATION)}});
+    }
+    QPCSCReader *r = PCSC->connectReader(this, name, params.value("protocol").toString("*"), true);
+    if (!r) {
+        PKI->resume();
+        return reply(id, {{"error", QtPCSC::errorName(SCARD_E_READER_UNAVAILABLE)}});
+    }
+    readers[name] = r;
+    connecting[id] = name;
+    connect(r, &QPCSCReader::disconnected, this, [this, name] (LONG err) {
+        _log("Disconnected: %s", QtPCSC::errorName(err));
+        PKI->resume();
+        // The id may have been reused by the page once the connect was
+        // answered, so look up by reader
+        const QString pending = connecting.key(name);
+        connecting.remove(pending);
+        if (readers.contains(name)) {
+            QPCSCReader *rd = readers.take(name);
+            // Answer the connect if it was not completed, otherwise
+            // the command that is running on the reader, if any.
+            // Queued commands for the reader fail once started.
+            QString current = !pending.isEmpty() ? pending : busy.value("reader:" + name);
+            if (!current.isEmpty()) {
+                if (err != SCARD_S_SUCCESS) {
+                    reply(current, {{"error", QtPCSC::errorName(err)}});
+                } else {
+                    reply(current, {});
+                }
+            } else {
+                // TODO: store lasterror
+            }
+            rd->deleteLater();
+        } else {
+            // Not yet connected
+        }
+    });
+    connect(r, &QPCSCReader::connected, this, [=] (QByteArray atr, QString proto) {
+        _log("connected: %s %s", qPrintable(proto), qPrintable(atr.toHex()));
+        PKI->resume();
+        connecting.remove(id);
+        // Index of the reader for binary frames
+        if (!indexes.contains(name) && indexes.size() <= 0xFF) {
+            indexes.append(name);
+        }
+        QJsonObject result = {{"name", name}, {"protocol", proto}, {"atr", QString(atr.toBase64())}};
+        if (indexes.contains(name)) {
+            result["index"] = indexes.indexOf(name);
+        }
+        reply(id, result);
+    });
+    connect(r, &QPCSCReader::reconnected, this, [=] (QByteArray atr, QString proto) {
+        _log("reconnected: %s %s", qPrintable(proto), qPrintable(atr.toHex()));
+        reply(busy.value("reader:" + name), {{"protocol", proto}, {"atr", QString(atr.toBase64())}});
+    });
+    connect(r, &QPCSCReader::received, this, [=] (QByteArray apdu) {
+        _log("Received apdu");
+        reply(busy.value("reader:" + name), {}, apdu);
+    });
+}
+
+// Cancel a request that is not answered yet. A running request is stopped
+// where possible: dialogs are closed and a connect is cancelled. Otherwise,
+// like a running APDU, the request is answered at once, but keeps its
+// resource until it is done and its late answer is dropped. The connection
+// and the card state stay, the watchdog resets the card if it never answers.
+// Returns false if there is no such request
+bool WebContext::cancel(const QString &target) {
+    if (!inflight.contains(target) || inflight.value(target).isEmpty()) {
+        return false;
+    }
+    const QString resource = inflight.value(target);
+    const char *error = resource == "pki" ? QPKI::errorName(CKR_FUNCTION_CANCELED) : QtPCSC::errorName(SCARD_E_CANCELLED);
+    _log("Cancelling %s on %s", qPrintable(target), qPrintable(resource));
+
+    // Still waiting for the resource
+    if (busy.value(resource) != target) {
+        QList<QJsonObject> &waiting = queued[resource];
+        for (int i = 0; i < waiting.size(); i++) {
+            if (waiting.at(i).value("id").toString() == target) {
+                waiting.removeAt(i);
+                break;
+            }
+        }
+        if (waiting.isEmpty()) {
+            queued.remove(resource);
+        }
+        reply(target, {{"error", error}});
+        return true;
+    }
+
+    if (resource == "connect" && readers.contains(connecting.value(target))) {
+        readers.value(connecting.value(target))->abort(SCARD_E_CANCELLED);
+    } else if (!resource.startsWith("reader:")) {
+        emit cancelled(resource);
     }
+    if (inflight.contains(target)) {
+        _log("%s can not be stopped, orphaned", qPrintable(target));
+        orphans[target] = resource;
+        reply(target, {{"error", error}});
+    }
+    return true;
 }
 
-void WebContext::outgoing(QVariantMap message) {
-    message["id"] = msgid;
-    msgid.clear();
-
-    QByteArray response = QJsonDocument::fromVariant(message).toJson(QJsonDocument::Compact);
-    QByteArray logmsg = QJsonDocument::fromVariant(message).toJson();
-    _log("Sending outgoing message:\n%s", logmsg.constData());
-    if (this->ls) {
-        quint32 msgsize = response.size();
-        ls->write((char *)&msgsize, sizeof(msgsize));
-        ls->write(response);
-    } else if(this->ws) {
-        ws->sendTextMessage(QString(response));
+// Answer the request and start the next queued request for the same resource
+void WebContext::reply(const QString &id, QJsonObject message, const QByteArray &bytes) {
+    if (!inflight.contains(id)) {
+        if (orphans.contains(id)) {
+            _log("Cancelled request %s is done, dropping reply", qPrintable(id));
+            return next(orphans.take(id));
+        }
+        _log("No request %s to answer, dropping reply", qPrintable(id));
+        return;
+    }
+    const QString resource = inflight.take(id);
+    limiter->release(origin);
+    raw.remove(id);
+    if (frames.contains(id)) {
+        const Frame f = frames.take(id);
+        if (message.contains("error")) {
+            emit sendingFrame(f.id, f.reader, ApduFrame::Error, message.value("error").toString().toLatin1());
+        } else {
+            emit sendingFrame(f.id, f.reader, 0, bytes);
+        }
     } else {
-        _log("Do not know where to send a reply for %s", qPrintable(msgid));
+        // The transport adds bytes as base64 or raw, by encoding
+        message["id"] = id;
+        outgoing(message, bytes);
+    }
+
+    if (!resource.isEmpty() && busy.value(resource) == id && !orphans.contains(id)) {
+        next(resource);
+    }
+    if (paused && !saturated()) {
+        QTimer::singleShot(0, this, [this] {
+            resume();
+        });
     }
 }
 
-void WebContext::terminate() {
-    if (ws) {
-        ws->abort();
-    } else if(ls) {
-        ls->abort();
+// Per-origin permission "<origin>/<permission>", or the global "<permission>"
+bool WebContext::isAllowed(const QString &permission, bool fallback) const {
+    QSettings settings;
+    return settings.value(QStringLiteral("%1/%2").arg(friendlyOrigin(), permission), settings.value(permission, fallback)).toBool();
+}
+
+// Readers from the last known state, without dialogs or PC/SC calls
+QJsonArray WebContext::listReaders() const {
+    QJsonArray result;
+    const auto current = PCSC->getReaders();
+    for (auto i = current.constBegin(); i != current.constEnd(); ++i) {
+        const QStringList &flags = i.value().second;
+        QJsonObject reader = {{"name", i.key()},
+                              {"present", flags.contains("PRESENT")},
+                              {"exclusive", flags.contains("EXCLUSIVE")},
+                              {"flags", QJsonArray::fromStringList(flags)}};
+        if (!i.value().first.isEmpty()) {
+            reader["atr"] = QString(i.value().first.toBase64());
+        }
+        result.append(reader);
+    }
+    return result;
+}
+
+// Certificates known to PKI with their metadata, without dialogs
+QJsonArray WebContext::listCertificates() const {
+    QJsonArray result;
+    for (const auto &c: PKI->getCertificates()) {
+        QJsonObject certificate = PKI->getCertificateInfo(c).toJson();
+        certificate["certificate"] = QString(c.toBase64());
+        result.append(certificate);
+    }
+    return result;
+}
+
+// Reader and card events, sent without a request as
+// {"subscription": id, "events": [{"event": "cardInserted", "reader": ..., "atr": ..., "flags": [...]}, ...]}
+// Events are coalesced by QtPCSC, those of one burst go in one message.
+// Filtered by reader names and card ATR-s, if given. The reply to subscribe
+// has the current state of the matching readers.
+QJsonObject WebContext::subscribe(const QString &id, const QJsonObject &params) {
+    Subscription sub;
+    for (const auto &r: params.value("readers").toArray()) {
+        sub.readers.append(r.toString());
+    }
+    for (const auto &a: params.value("atrs").toArray()) {
+        sub.atrs.append(QByteArray::fromBase64(a.toString().toLatin1()));
+    }
+    QJsonArray readers;
+    const auto current = PCSC->getReaders();
+    for (auto i = current.constBegin(); i != current.constEnd(); ++i) {
+        const QByteArray &atr = i.value().first;
+        if (!sub.readers.isEmpty() && !sub.readers.contains(i.key())) {
+            continue;
+        }
+        if (!sub.atrs.isEmpty()) {
+            if (!sub.atrs.contains(atr)) {
+                continue;
+            }
+            sub.present.insert(i.key());
+        }
+        QJsonObject reader = {{"name", i.key()}, {"flags", QJsonArray::fromStringList(i.value().second)}};
+        if (!atr.isEmpty()) {
+            reader["atr"] = QString(atr.toBase64());
+        }
+        readers.append(reader);
+    }
+    if (subscriptions.isEmpty()) {
+        connect(PCSC, &QtPCSC::readerAttached, this, [this] (const QString &name) {
+            notify("readerAttached", name, QByteArray(), QStringList());
+        });
+        connect(PCSC, &QtPCSC::readerRemoved, this, [this] (const QString &name) {
+            notify("readerRemoved", name, QByteArray(), QStringList());
+        });
+        connect(PCSC, &QtPCSC::cardInserted, this, [this] (const QString &reader, const QByteArray &atr, const QStringList &flags) {
+            notify("cardInserted", reader, atr, flags);
+        });
+        connect(PCSC, &QtPCSC::cardRemoved, this, [this] (const QString &reader) {
+            notify("cardRemoved", reader, QByteArray(), QStringList());
+        });
+        connect(PCSC, &QtPCSC::readerChanged, this, [this] (const QString &reader, const QByteArray &atr, const QStringList &flags) {
+            notify("readerChanged", reader, atr, flags);
+        });
+    }
+    subscriptions[id] = sub;
+    _log("%s subscribed to reader events (%d subscriptions)", qPrintable(origin), subscriptions.size());
+    return {{"subscription", id}, {"readers", readers}};
+}
+
+bool WebContext::unsubscribe(const QString &id) {
+    if (!subscriptions.remove(id)) {
+        return false;
+    }
+    if (subscriptions.isEmpty()) {
+        QObject::disconnect(PCSC, &QtPCSC::readerAttached, this, nullptr);
+        QObject::disconnect(PCSC, &QtPCSC::readerRemoved, this, nullptr);
+        QObject::disconnect(PCSC, &QtPCSC::cardInserted, this, nullptr);
+        QObject::disconnect(PCSC, &QtPCSC::cardRemoved, this, nullptr);
+        QObject::disconnect(PCSC, &QtPCSC::readerChanged, this, nullptr);
+    }
+    return true;
+}
+
+void WebContext::notify(const QString &event, const QString &reader, const QByteArray &atr, const QStringList &flags) {
+    for (auto i = subscriptions.begin(); i != subscriptions.end(); ++i) {
+        Subscription &sub = i.value();
+        if (!sub.readers.isEmpty() && !sub.readers.contains(reader)) {
+            continue;
+        }
+        // Removals are reported where a matching card was
+        if (!sub.atrs.isEmpty()) {
+            if (sub.atrs.contains(atr)) {
+                sub.present.insert(reader);
+            } else if (!sub.present.remove(reader)) {
+                continue;
+            }
+        }
+        QJsonObject e = {{"event", event}, {"reader", reader}};
+        if (!atr.isEmpty()) {
+            e["atr"] = QString(atr.toBase64());
+        }
+        if (!flags.isEmpty()) {
+            e["flags"] = QJsonArray::fromStringList(flags);
+        }
+        sub.pending.append(e);
+        if (!notifying) {
+            notifying = true;
+            QTimer::singleShot(0, this, [this] {
+                notifying = false;
+                for (auto j = subscriptions.begin(); j != subscriptions.end(); ++j) {
+                    if (!j.value().pending.isEmpty()) {
+                        outgoing({{"subscription", j.key()}, {"events", j.value().pending}});
+                        j.value().pending = QJsonArray();
+                    }
+                }
+            });
+        }
     }
 }
 
+// The resource is free, start the next request waiting for it
+void WebContext::next(const QString &resource) {
+    busy.remove(resource);
+    if (queued.contains(resource)) {
+        QJsonObject message = queued[resource].takeFirst();
+        if (queued[resource].isEmpty()) {
+            queued.remove(resource);
+        }
+        start(message);
+    }
+}
+
+// Serialized and sent in the I/O thread
+void WebContext::outgoing(const QJsonObject &message, const QByteArray &bytes) {
+    emit sending(message, bytes);
+}
+
+void WebContext::terminate() {
+    emit terminating();
+}
+
 QString WebContext::friendlyOrigin() const {
 
     QUrl url(origin);
@@ -4,26 +4,31 @@
 
 #pragma once
 
-#include <QWebSocket>
-#include <QLocalSocket>
 #include <QDialog>
 #include <QUuid>
 #include <QTimer>
 #include <QFutureWatcher>
+#include <QJsonArray>
+#include <QJsonObject>
+#include <QSet>
 
 class QtPCSC;
 class QPCSCReader;
 class QPKI;
+class RateLimiter;
+class Transport;
 
-// Handles a browser context, either
-// via WebSocket or LocalSocket, which it owns.
-// Lives in main thread, is created by main.cpp
+// Handles a browser context, either via WebSocket or LocalSocket.
+// Lives in main thread, where requests are dispatched, and is created by
+// main.cpp. The socket is owned by Transport in the I/O thread, see transport.h
+// TODO: dispatch SCardTransmit off the GUI thread. The queue of every reader
+// is kept here and the replies of a reader worker carry no request id, so
+// APDU-s can not simply bypass WebContext.
 class WebContext: public QObject {
     Q_OBJECT
 
 public:
-    WebContext(QObject *parent, QWebSocket *client);
-    WebContext(QObject *parent, QLocalSocket *client);
+    WebContext(QObject *parent, Transport *transport);
 
     const QString id = QUuid::createUuid().toString();
 
@@ -36,22 +41,75 @@ public:
 
     // Any running UI widget, associated with the context
     QDialog *dialog = nullptr;
-    void outgoing(QVariantMap message); // So that main.cpp could send version on connect
+    // Answer request id, message gets the id. bytes go raw to frames and as base64 "bytes" to JSON
+    void reply(const QString &id, QJsonObject message, const QByteArray &bytes = QByteArray());
+    void outgoing(const QJsonObject &message, const QByteArray &bytes = QByteArray()); // So that main.cpp could send version on connect
 
 signals:
     void disconnected();
+    // A running request on resource was cancelled, close its dialogs
+    void cancelled(const QString &resource);
+
+    // To the transport
+    void sending(const QJsonObject &message, const QByteArray &bytes);
+    void sendingFrame(quint32 id, quint8 reader, quint8 flags, const QByteArray &payload);
+    void pausing(bool paused);
+    void terminating();
 
 private:
-    void processMessage(const QVariantMap &message); // Message received from client
+    void forget();
+    void admit(const QJsonObject &message);
+    void frameReceived(quint32 id, quint8 reader, const QByteArray &apdu);
+    void resume();
+    void refuse(const QString &id, const QString &error);
+    bool saturated() const { return inflight.size() >= window; };
+    void processMessage(const QJsonObject &message); // Message received from client
+    void start(const QJsonObject &message); // Run a request once its resource is free
+    void next(const QString &resource);
+    bool cancel(const QString &id);
+    bool isAllowed(const QString &permission, bool fallback) const;
+    QJsonArray listReaders() const;
+    QJsonArray listCertificates() const;
+    QJsonObject subscribe(const QString &id, const QJsonObject &params);
+    bool unsubscribe(const QString &id);
+    void connectReader(const QString &id, const QJsonObject &params, const QString &name);
+    void notify(const QString &event, const QString &reader, const QByteArray &atr, const QStringList &flags);
 
-    // message transport
-    QWebSocket *ws = nullptr;
-    QLocalSocket *ls = nullptr;
+    bool local = false; // via the local socket, which blocks instead of refusing
 
     // browser context
-    QString msgid;
+    QMap<QString, QString> inflight; // id of every unanswered request to the resource it uses
+    QMap<QString, QString> busy; // resource to the id of the request running on it
+    QMap<QString, QList<QJsonObject>> queued; // requests waiting for a busy resource
+    QMap<QString, QString> orphans; // cancelled requests that still hold their resource
+    QMap<QString, QString> connecting; // SCardConnect id to the reader being connected
+    struct Frame {
+        quint32 id;
+        quint8 reader;
+        QByteArray apdu;
+    };
+    QMap<QString, Frame> frames; // requests that came as binary frames, by "frame:<id>"
+    QMap<QString, QByteArray> raw; // APDU-s of SCardTransmit that came raw in CBOR, by id
+    QStringList indexes; // connected readers by index, for binary frames
     QPKI *PKI;
     QtPCSC *PCSC;
+    RateLimiter *limiter;
+
+    // Backpressure: at most window unanswered requests, more wait in the
+    // backlog and the local socket is not read
+    int window = 16;
+    bool paused = false;
+    QList<QJsonObject> backlog; // messages over the window
+
+    // Reader event subscriptions by id
+    struct Subscription {
+        QStringList readers;
+        QList<QByteArray> atrs;
+        QSet<QString> present; // readers with a matching card
+        QJsonArray pending; // events to send
+    };
+    QMap<QString, Subscription> subscriptions;
+    bool notifying = false;
 
     // Used readers
     QMap<QString, QPCSCReader *> readers;
@@ -16,6 +16,8 @@
 
 #include <QStandardItemModel>
 #include <QComboBox>
+#include <QCheckBox>
+#include <QSettings>
 
 #include <QDialogButtonBox>
 #include <QLabel>
@@ -27,15 +29,23 @@ class QtSelectCertificate: public BetterDialog {
 
 public:
 
-    QtSelectCertificate(const WebContext *ctx, const CertificatePurpose certtype):
+    QtSelectCertificate(const WebContext *ctx, const CertificatePurpose certtype, const QPKI *pki):
         type(certtype),
+        pki(pki),
         layout(new QVBoxLayout(this)),
         message(new QLabel(this)),
         select(new QComboBox(this)),
+        remember(new QCheckBox(this)),
         buttons(new QDialogButtonBox(this))
     {
+        QSettings settings;
+        remembered = settings.value(ctx->friendlyOrigin() + "/" + "authCertificate").toString();
         layout->addWidget(message);
         layout->addWidget(select);
+        // Only authentication certificates are remembered, signing needs a choice
+        remember->setText(tr("Always use this certificate"));
+        remember->setVisible(type == Authentication);
+        layout->addWidget(remember);
         layout->addWidget(buttons);
 
         layout->setSizeConstraint(QLayout::SetFixedSize);
@@ -64,7 +74,15 @@ public:
         connect(this, &QDialog::accepted, [this, ctx] {
             // Find the certificate with the matching name
             for (const auto &c: certs) {
-                if (certName(c) == select->currentText()) {
+                if (infos.value(c).name == select->currentText()) {
+                    if (type == Authentication) {
+                        QSettings settings;
+                        if (remember->isChecked()) {
+                            settings.setValue(ctx->friendlyOrigin() + "/" + "authCertificate", infos.value(c).handle);
+                        } else if (remembered == infos.value(c).handle) {
+                            settings.remove(ctx->friendlyOrigin() + "/" + "authCertificate");
+                        }
+                    }
                     return emit certificateSelected(c);
                 }
             }
@@ -74,6 +92,12 @@ public:
             if (!text.isEmpty()) {
                 _log("Item changed to %s", qPrintable(text));
             }
+            remember->setChecked(false);
+            for (const auto &c: certs) {
+                if (infos.value(c).name == text) {
+                    remember->setChecked(!remembered.isEmpty() && infos.value(c).handle == remembered);
+                }
+            }
             //    ok->setEnabled(true);
             //    ok->setDefault(true);
             //    ok->setFocus();
@@ -85,10 +109,13 @@ public slots:
     // Called from PKI after QtPKI::refresh() when a card has been inserted and certificate list changes.
     void update(const QVector<QByteArray> &newcerts) {
         QVector<QByteArray> certs;
+        infos.clear();
         // Filter by usage.
         for (const auto &c: newcerts) {
-            if (QPKI::usageMatches(c, type)) {
+            const CertificateInfo info = pki->getCertificateInfo(c);
+            if (info.matches(type)) {
                 certs.append(c);
+                infos[c] = info;
             }
         }
         this->certs = certs;
@@ -104,10 +131,9 @@ public slots:
         } else if (certs.size() == 1) {
             ok->setText(tr("OK"));
 
-            QSslCertificate x509(certs.at(0), QSsl::Der);
-            QString cname = certName(certs.at(0));
+            QString cname = infos.value(certs.at(0)).name;
             select->addItems({cname});
-            if (QDateTime::currentDateTime() >= x509.expiryDate()) {
+            if (infos.value(certs.at(0)).isExpired()) {
                 ok->setEnabled(false);
                 cancel->setDefault(true);
                 cancel->setFocus();
@@ -123,23 +149,28 @@ public slots:
             message->setText(type == Authentication ? tr("Select certificate for authentication") : tr("Select certificate for signing"));
 
             for (const auto &c: certs) {
-                select->addItem(certName(c));
+                select->addItem(infos.value(c).name);
             }
 
             // Disable expired certs
             QStandardItemModel* model = qobject_cast<QStandardItemModel*>(select->model());
             for (const auto &c: certs) {
-                QSslCertificate x509(c, QSsl::Der);
-                QString cname = certName(c);
+                QString cname = infos.value(c).name;
                 QStandardItem *item = model->findItems(cname).at(0);
 
-                if (QDateTime::currentDateTime() >= x509.expiryDate()) {
+                if (infos.value(c).isExpired()) {
                     item->setEnabled(false);
                     item->setToolTip(tr("Certificate has expired"));
                 } else {
                     select->setCurrentText(cname);
                 }
             }
+            // Prefer the remembered certificate
+            for (const auto &c: certs) {
+                if (infos.value(c).handle == remembered && !infos.value(c).isExpired()) {
+                    select->setCurrentText(infos.value(c).name);
+                }
+            }
 
 
             ok->show();
@@ -168,7 +199,7 @@ public slots:
             // If we currently have only one certificate, re-show the select box.
             if (certs.size() == 1) {
                 select->clear();
-                select->addItems({certName(certs.at(0))});
+                select->addItems({infos.value(certs.at(0)).name});
                 select->show();
             }
         }
@@ -187,33 +218,19 @@ public slots:
         });
     }
 
-    QString certName(const QByteArray &c) {
-        QString crt;
-
-        QSslCertificate cert(c, QSsl::Der);
-        if (cert.isNull())
-        {
-            _log("Could not parse certificate");
-            return QString();
-        }
-
-        if (cert.subjectInfo(QSslCertificate::Organization).size() > 0)
-        {
-            crt += cert.subjectInfo(QSslCertificate::Organization).at(0) + ": ";
-        }
-        crt += cert.subjectInfo(QSslCertificate::CommonName).at(0) + " ";
-        return crt;
-    }
-
 signals:
     void certificateSelected(const QByteArray &cert);
 
 private:
     CertificatePurpose type;
+    const QPKI *pki;
     QVector<QByteArray> certs;
+    QMap<QByteArray, CertificateInfo> infos; // of certs
     QVBoxLayout *layout;
     QLabel *message;
     QComboBox *select;
+    QCheckBox *remember;
+    QString remembered; // handle of the remembered authentication certificate
     QDialogButtonBox *buttons;
     QPushButton *ok;
     QPushButton *cancel;
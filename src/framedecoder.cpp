@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) 2017 Martin Paljak
+ */
+
+#include "framedecoder.h"
+
+#include <cstring>
+
+// Consumed data is dropped from the buffer once it is this large
+static const int compactSize = 64 * 1024;
+
+bool FrameDecoder::check() {
+    if (!failed && buffer.size() - offset >= int(sizeof(quint32))) {
+        quint32 size = 0;
+        memcpy(&size, buffer.constData() + offset, sizeof(size));
+        failed = size > maxSize;
+    }
+    return !failed;
+}
+
+bool FrameDecoder::feed(const QByteArray &data) {
+    if (failed) {
+        return false;
+    }
+    buffer.append(data);
+    return check();
+}
+
+FrameDecoder::Status FrameDecoder::next(QByteArray &message) {
+    if (!check()) {
+        return Oversized;
+    }
+    if (buffer.size() - offset < int(sizeof(quint32))) {
+        return Incomplete;
+    }
+    quint32 size = 0;
+    memcpy(&size, buffer.constData() + offset, sizeof(size));
+    if (quint32(buffer.size() - offset) - sizeof(size) < size) {
+        return Incomplete;
+    }
+    message = buffer.mid(offset + sizeof(size), int(size));
+    offset += sizeof(size) + size;
+    if (offset == buffer.size()) {
+        buffer.clear();
+        offset = 0;
+    } else if (offset >= compactSize) {
+        buffer.remove(0, offset);
+        offset = 0;
+    }
+    return Complete;
+}
+
+QByteArray FrameDecoder::encode(const QByteArray &message) {
+    quint32 size = message.size();
+    QByteArray result(sizeof(size), Qt::Uninitialized);
+    memcpy(result.data(), &size, sizeof(size));
+    return result.append(message);
+}
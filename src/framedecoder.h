@@ -0,0 +1,44 @@
+/*
+ * Copyright (C) 2017 Martin Paljak
+ */
+
+#pragma once
+
+#include <QByteArray>
+
+/*
+Incremental decoder for the length prefixed messages of the local socket and
+native messaging (a 32 bit length in native byte order, then the message).
+Data is fed as it arrives, complete messages are taken out in order, any
+number per read. A length over the maximum size, of the first message or of
+any later one, fails the decoder for good, as the stream can not be
+resynchronized.
+*/
+class FrameDecoder {
+public:
+    static const quint32 defaultMaxSize = 1024 * 1024;
+
+    enum Status {
+        Incomplete, // more data is needed
+        Complete,
+        Oversized // the stream is dead
+    };
+
+    explicit FrameDecoder(quint32 maxSize = defaultMaxSize): maxSize(maxSize) {};
+
+    // Returns false if the stream has a message over the maximum size
+    bool feed(const QByteArray &data);
+    // Takes the next complete message, if any
+    Status next(QByteArray &message);
+    bool oversized() const { return failed; };
+
+    static QByteArray encode(const QByteArray &message);
+
+private:
+    bool check();
+
+    quint32 maxSize;
+    QByteArray buffer;
+    int offset = 0; // start of the next message in buffer
+    bool failed = false;
+};
@@ -0,0 +1,89 @@
+/*
+ * Copyright (C) 2017 Martin Paljak
+ */
+
+#include "hotplug.h"
+
+#include "debuglog.h"
+
+#include <QSocketNotifier>
+
+#ifdef Q_OS_LINUX
+#include <linux/netlink.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#endif
+
+HotplugMonitor::~HotplugMonitor() {
+    delete notifier;
+#ifdef Q_OS_LINUX
+    if (fd >= 0) {
+        close(fd);
+    }
+#endif
+}
+
+bool HotplugMonitor::start(QObject *context) {
+#ifdef Q_OS_LINUX
+    fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_KOBJECT_UEVENT);
+    if (fd < 0) {
+        _log("Could not open uevent socket: %s", strerror(errno));
+        return false;
+    }
+    struct sockaddr_nl addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = 1; // Events from the kernel
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        _log("Could not bind uevent socket: %s", strerror(errno));
+        close(fd);
+        fd = -1;
+        return false;
+    }
+    notifier = new QSocketNotifier(fd, QSocketNotifier::Read);
+    QObject::connect(notifier, &QSocketNotifier::activated, context, [this] {
+        receive();
+    });
+    _log("Watching for USB smart card readers");
+    return true;
+#else
+    (void)context;
+    return false;
+#endif
+}
+
+// Messages are "action@devpath" followed by KEY=VALUE pairs, all NUL terminated
+void HotplugMonitor::receive() {
+#ifdef Q_OS_LINUX
+    char buffer[8192];
+    for (;;) {
+        ssize_t len = recv(fd, buffer, sizeof(buffer) - 1, 0);
+        if (len <= 0) {
+            return;
+        }
+        buffer[len] = 0;
+        QString action;
+        QString device;
+        bool usbInterface = false;
+        bool ccid = false;
+        for (ssize_t i = 0; i < len; i += strlen(buffer + i) + 1) {
+            QString field = QString::fromLatin1(buffer + i);
+            if (field.startsWith("ACTION=")) {
+                action = field.mid(7);
+            } else if (field.startsWith("DEVPATH=")) {
+                device = field.mid(8);
+            } else if (field == "DEVTYPE=usb_interface") {
+                usbInterface = true;
+            } else if (field.startsWith("INTERFACE=11/")) {
+                ccid = true;
+            }
+        }
+        if (usbInterface && ccid && (action == "add" || action == "remove")) {
+            _log("Smart card reader %s: %s", qPrintable(action), qPrintable(device));
+            callback(action, device);
+        }
+    }
+#endif
+}
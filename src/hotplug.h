@@ -0,0 +1,35 @@
+/*
+ * Copyright (C) 2017 Martin Paljak
+ */
+
+#pragma once
+
+#include <QObject>
+#include <QString>
+
+#include <functional>
+
+class QSocketNotifier;
+
+// Watches kernel uevents for USB smart card readers (CCID, interface
+// class 0x0B), to notice new readers on machines without PC/SC PnP.
+// Talks netlink directly, without libudev. Only available on Linux.
+class HotplugMonitor {
+public:
+    // action is "add" or "remove", called in the thread of the context
+    typedef std::function<void(const QString &action, const QString &device)> Callback;
+
+    explicit HotplugMonitor(Callback callback): callback(callback) {};
+    ~HotplugMonitor();
+
+    // Call from the thread of context. Returns false if not
+    // supported or the socket can not be opened
+    bool start(QObject *context);
+
+private:
+    void receive();
+
+    Callback callback;
+    int fd = -1;
+    QSocketNotifier *notifier = nullptr;
+};
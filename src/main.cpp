@@ -207,6 +207,14 @@ QtHost::QtHost(int &argc, char *argv[]) : QApplication(argc, argv), PKI(&this->P
         settings.setValue("softCert", checked);
     });
 
+    QAction *recordPCSC = debugMenu->addAction(tr("Record card sessions"));
+    recordPCSC->setCheckable(true);
+    recordPCSC->setChecked(settings.value("recordPCSC", false).toBool());
+    connect(recordPCSC, &QAction::toggled, this, [=] (bool checked) {
+        QSettings settings;
+        settings.setValue("recordPCSC", checked);
+    });
+
 #ifdef Q_OS_WIN
     ownDialogsEnabled = debugMenu->addAction(tr("Use own certificate dialogs"));
     ownDialogsEnabled->setCheckable(true);
@@ -222,22 +230,14 @@ QtHost::QtHost(int &argc, char *argv[]) : QApplication(argc, argv), PKI(&this->P
     websocket->setCheckable(true);
     websocket->setChecked(true);
     connect(websocket, &QAction::toggled, this, [=] (bool checked) {
-        // XXX this is redundant if no accepts are done
-        wsEnabled = checked;
-        if (wsEnabled) {
-            ws->pauseAccepting();
-            ws6->pauseAccepting();
-        } else {
-            ws->resumeAccepting();
-            ws6->resumeAccepting();
-        }
+        QMetaObject::invokeMethod(server, "setWebSocketEnabled", Q_ARG(bool, checked));
     });
 
     QAction *localsocket = debugMenu->addAction(tr("WebExtension enabled"));
     localsocket->setCheckable(true);
     localsocket->setChecked(true);
     connect(localsocket, &QAction::toggled, this, [=] (bool checked) {
-        lsEnabled = checked;
+        QMetaObject::invokeMethod(server, "setLocalSocketEnabled", Q_ARG(bool, checked));
     });
 
     QAction *native = debugMenu->addAction(tr("WebExtension registered"));
@@ -262,54 +262,16 @@ QtHost::QtHost(int &argc, char *argv[]) : QApplication(argc, argv), PKI(&this->P
     QAction *a2 = menu->addAction(tr("Quit"));
     connect(a2, &QAction::triggered, this, &QApplication::quit);
 
-    // Initialize listening servers
-    ws = new QWebSocketServer(QStringLiteral("Web eID"), QWebSocketServer::NonSecureMode, this);
-    ws6 = new QWebSocketServer(QStringLiteral("Web eID"), QWebSocketServer::NonSecureMode, this);
-    ls = new QLocalServer(this);
-    quint16 port = 59735;
-
+    // Initialize listening servers, in the I/O thread
+    server = new TransportServer();
+    server->moveToThread(&io);
+    connect(&io, &QThread::finished, server, &QObject::deleteLater);
+    connect(server, &TransportServer::connected, this, [this] (Transport *transport) {
+        newConnection(new WebContext(this, transport));
+    });
+    io.start();
     QString serverUrlDescription;
-
-    if (ws6->listen(QHostAddress::LocalHostIPv6, port)) {
-        serverUrlDescription = ws6->serverUrl().toString();
-        _log("Server running on %s", qPrintable(serverUrlDescription));
-        connect(ws6, &QWebSocketServer::originAuthenticationRequired, this, &QtHost::checkOrigin);
-        connect(ws6, &QWebSocketServer::newConnection, this, &QtHost::processConnect);
-    } else {
-        _log("Could not listen on v6 %d", port);
-    }
-
-    if (ws->listen(QHostAddress::LocalHost, port)) {
-        serverUrlDescription = ws->serverUrl().toString();
-        _log("Server running on %s", qPrintable(serverUrlDescription));
-        connect(ws, &QWebSocketServer::originAuthenticationRequired, this, &QtHost::checkOrigin);
-        connect(ws, &QWebSocketServer::newConnection, this, &QtHost::processConnect);
-    } else {
-        _log("Could not listen on %d", port);
-    }
-
-    // TODO: shared file between app and nm-proxy
-    // Set up local server
-    QString serverName;
-#if defined(Q_OS_MACOS)
-    // /tmp/martin-webeid
-    serverName = QDir("/tmp").filePath(qgetenv("USER") + "-webeid");
-#elif defined(Q_OS_WIN32)
-    // \\.\pipe\Martin_Paljak-webeid
-    serverName = qgetenv("USERNAME").simplified().replace(" ", "_") + "-webeid";
-#elif defined(Q_OS_LINUX)
-    // /run/user/1000/webeid-socket
-    serverName = QDir(QStandardPaths::writableLocation(QStandardPaths::RuntimeLocation)).filePath("webeid-socket");
-#else
-#error "Unsupported platform"
-#endif
-
-    ls->setSocketOptions(QLocalServer::UserAccessOption);
-
-    if (ls->listen(serverName)) {
-        _log("Listening on %s", qPrintable(ls->fullServerName()));
-        connect(ls, &QLocalServer::newConnection, this, &QtHost::processConnectLocal);
-    }
+    QMetaObject::invokeMethod(server, "listen", Qt::BlockingQueuedConnection, Q_RETURN_ARG(QString, serverUrlDescription));
 
     tray.setContextMenu(menu);
     tray.setToolTip(tr("Web eID is running %1").arg(serverUrlDescription));
@@ -356,40 +318,10 @@ QtHost::QtHost(int &argc, char *argv[]) : QApplication(argc, argv), PKI(&this->P
 
 }
 
-// We allo websocket connections only from secure origins
-void QtHost::checkOrigin(QWebSocketCorsAuthenticator *authenticator) {
-    if (WebContext::isSecureOrigin(authenticator->origin())) {
-        authenticator->setAllowed(true);
-    } else {
-        authenticator->setAllowed(false);
-    }
-}
-
-void QtHost::processConnectLocal() {
-    QLocalSocket *socket = ls->nextPendingConnection();
-    _log("New connection to local socket");
-    if (!lsEnabled)
-        return socket->abort();
-    WebContext *ctx = new WebContext(this, socket);
-    newConnection(ctx);
-}
-
-void QtHost::processConnect() {
-    QWebSocket *client;
-    if (ws->hasPendingConnections()) {
-        client = ws->nextPendingConnection();
-    } else if (ws6->hasPendingConnections()) {
-        client = ws6->nextPendingConnection();
-    } else {
-        return;
-    }
-    _log("Connection to %s from %s:%d (%s)", qPrintable(client->requestUrl().toString()), qPrintable(client->peerAddress().toString()), client->peerPort(), qPrintable(client->origin()));
-    _log("UA: %s", qPrintable(client->request().header(QNetworkRequest::UserAgentHeader).toString()));
-    if (!wsEnabled) {
-        return client->close(QWebSocketProtocol::CloseCodePolicyViolated);
+void QtHost::notify(const QString &message) {
+    if (QSystemTrayIcon::supportsMessages() && tray.isVisible()) {
+        tray.showMessage(tr("Web eID"), message, QSystemTrayIcon::Information, 3000);
     }
-    WebContext *ctx = new WebContext(this, client);
-    newConnection(ctx);
 }
 
 void QtHost::newConnection(WebContext *ctx) {
@@ -7,6 +7,8 @@
 #include "pkcs11module.h"
 #include "qpki.h"
 #include "context.h"
+#include "ratelimiter.h"
+#include "transport.h"
 
 #include <QApplication>
 #include <QSystemTrayIcon>
@@ -14,10 +16,7 @@
 #include <QFile>
 #include <QVariantMap>
 #include <QJsonObject>
-
-#include <QtWebSockets/QtWebSockets>
-#include <QWebSocketServer>
-#include <QLocalServer>
+#include <QThread>
 
 #ifdef _WIN32
 #include <qt_windows.h>
@@ -34,17 +33,18 @@ class QtHost: public QApplication
 
 public:
     QtHost(int &argc, char *argv[]);
+    ~QtHost() {
+        io.quit();
+        io.wait();
+    }
 
     // PCSC and PKI subsystems
     QtPCSC PCSC;
     QPKI PKI;
+    RateLimiter limiter;
 
-public slots:
-    // connect new clients
-    void processConnect();
-    void processConnectLocal();
-
-    void checkOrigin(QWebSocketCorsAuthenticator *authenticator);
+    // Non-blocking notification from the tray
+    void notify(const QString &message);
 
 private:
     void newConnection(WebContext *ctx);
@@ -60,12 +60,9 @@ private:
     QAction *ownDialogsEnabled;
 #endif
 
-    QWebSocketServer *ws; // IPv4
-    QWebSocketServer *ws6; // IPv6
-    bool wsEnabled = true;
-
-    QLocalServer *ls; // localsocket
-    bool lsEnabled = true;
+    // Listening sockets and protocol I/O
+    QThread io;
+    TransportServer *server;
 
     // Active contexts
     QMap<QString, WebContext *> contexts;
@@ -3,6 +3,8 @@
  */
 
 #include "../debuglog.h"
+#include "../framedecoder.h"
+#include "../cbor.h"
 
 #include <QCoreApplication>
 #include <QCommandLineParser>
@@ -42,11 +44,15 @@ public:
         // Here we do busy-sleep
         while (std::cin.read((char*)&messageLength, sizeof(messageLength))) {
             _log("Message size: %u", messageLength);
+            if (messageLength > FrameDecoder::defaultMaxSize) {
+                // The stream can not be followed any more
+                emit oversized(messageLength);
+                return;
+            }
             QByteArray msg(int(messageLength), 0);
             std::cin.read(msg.data(), msg.size());
             _log("Message (%u): %s", messageLength, msg.constData());
-            QVariantMap json = QJsonDocument::fromJson(msg).toVariant().toMap();
-            emit fromBrowser(json);
+            emit fromBrowser(msg);
         }
         _log("Input reading thread is done.");
         // If input is closed, we quit
@@ -54,7 +60,8 @@ public:
     }
 
 signals:
-    void fromBrowser(const QVariantMap &msg);
+    void fromBrowser(const QByteArray &msg);
+    void oversized(quint32 size);
 };
 
 class NMBridge: public QCoreApplication
@@ -201,66 +208,92 @@ public slots:
         out.open(stdout, QFile::WriteOnly);
         input = new InputChecker(this);
         connect(input, &InputChecker::fromBrowser, this, &NMBridge::toApp, Qt::QueuedConnection);
+        connect(input, &InputChecker::oversized, this, [this] (quint32 size) {
+            _log("Message of %u bytes from browser is too large", size);
+            toBrowser("{\"error\":\"protocol\"}");
+            exit(1);
+        }, Qt::QueuedConnection);
 
         server_started = 0; //FIXME: remove
 
         connect(sock, &QLocalSocket::readyRead, [this] {
-            // Data available from app, read message and pass to browser
-            _log("Handling message from application");
+            // Data available from app, read messages and pass to browser
             _log("%d bytes available from app", sock->bytesAvailable());
-            quint32 msgsize = 0;
-            if (sock->bytesAvailable() < qint64(sizeof(msgsize) + 1)) {
-                _log("Not enought data available %d, waiting for next update", sock->bytesAvailable());
+            if (!decoder.feed(sock->readAll())) {
+                _log("Bad message size, closing");
+                sock->abort();
                 return;
             }
-            if (sock->read((char*)&msgsize, sizeof(msgsize)) == sizeof(msgsize)) {
-                if (msgsize > 8 * 1024) {
-                    _log("Bad message size, closing");
-                    sock->abort();
-                    return;
+            QByteArray msg;
+            FrameDecoder::Status status;
+            while ((status = decoder.next(msg)) == FrameDecoder::Complete) {
+                // The browser gets JSON
+                if (cbor && Cbor::isCbor(msg)) {
+                    toBrowser(QJsonDocument(Cbor::decode(msg)).toJson(QJsonDocument::Compact));
+                    continue;
                 }
-                QByteArray msg(int(msgsize), 0);
-                qint64 readsize = sock->read(msg.data(), msgsize) ;
-                if (readsize == msgsize) {
-                    _log("Read message of %d bytes", msgsize);
-                    // Pass verbatim from app to browser
-                    quint32 responseLength = msg.size();
-                    _log("Response(%u) %s", responseLength, msg.constData());
-                    out.write((const char*)&responseLength, sizeof(responseLength));
-                    out.write(msg);
-                    out.flush();
-                } else {
-                    _log("Could not read message, read %d of %d", readsize, msgsize);
-                    sock->abort();
+                // Answer to our hello, keepalive of the app. Pings are always JSON
+                if (msg.contains("\"internal\"")) {
+                    QJsonObject json = QJsonDocument::fromJson(msg).object();
+                    if (json.value("internal").toString() == "ping") {
+                        sock->write(FrameDecoder::encode("{\"internal\":\"pong\"}"));
+                        continue;
+                    }
+                    if (json.value("internal").toString() == "hello") {
+                        cbor = json.value("encoding").toString() == "cbor";
+                        _log("Using %s with app", cbor ? "CBOR" : "JSON");
+                        continue;
+                    }
                 }
-            } else {
-                _log("Could not read message size");
-                // TODO: shutdown? close? abort?
+                // Pass verbatim from app to browser
+                toBrowser(msg);
+            }
+            // A later message in the same read can be too large as well
+            if (status == FrameDecoder::Oversized) {
+                _log("Bad message size, closing");
                 sock->abort();
             }
         });
 
         // Quit the app
         if (args.contains("--quit")) {
-            toApp({{"internal", "quit"}});
+            toApp("{\"internal\":\"quit\"}");
             return quit();
         }
 
+        // Tell the app that pings are answered and offer CBOR, messages are
+        // converted from JSON only here
+        if (Cbor::isSupported()) {
+            sock->write(FrameDecoder::encode("{\"internal\":\"hello\",\"ping\":true,\"encodings\":[\"cbor\"]}"));
+        } else {
+            sock->write(FrameDecoder::encode("{\"internal\":\"hello\",\"ping\":true}"));
+        }
+
         // Start input reading thread, if not already running
         if (!input->isRunning()) {
             input->start();
         }
     }
 
-    void toApp(QVariantMap msg) {
+    void toBrowser(const QByteArray &msg) {
+        _log("Response(%d) %s", msg.size(), msg.constData());
+        out.write(FrameDecoder::encode(msg));
+        out.flush();
+    }
+
+    void toApp(const QByteArray &msg) {
         _log("Handling message from browser");
-        // Enrich with information about browser
-        msg["browser"] = browser;
-        QByteArray json =  QJsonDocument::fromVariant(msg).toJson();
-        quint32 msglen = json.size();
+        QJsonParseError error;
+        QJsonDocument doc = QJsonDocument::fromJson(msg, &error);
+        if (error.error != QJsonParseError::NoError || !doc.isObject()) {
+            _log("Message from browser is not a JSON object: %s", qPrintable(error.errorString()));
+            return toBrowser("{\"error\":\"protocol\"}");
+        }
+        // Enrich with information about browser, overriding whatever the page sent
+        QJsonObject message = doc.object();
+        message["browser"] = browser;
         // TODO: error handling?
-        sock->write((const char*)&msglen, sizeof(msglen));
-        sock->write(json);
+        sock->write(FrameDecoder::encode(cbor ? Cbor::encode(message) : QJsonDocument(message).toJson(QJsonDocument::Compact)));
         sock->flush();
     }
 
@@ -272,8 +305,11 @@ private:
     QString serverApp;
     InputChecker *input;
     QFile out;
+    // Messages to the browser can be 1MB at most
+    FrameDecoder decoder;
     QString browser;
     QStringList args;
+    bool cbor = false; // The app speaks CBOR
 };
 
 int main(int argc, char *argv[]) {
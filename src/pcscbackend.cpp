@@ -0,0 +1,89 @@
+/*
+ * Copyright (C) 2017 Martin Paljak
+ */
+
+#include "pcscbackend.h"
+#include "virtualpcsc.h"
+
+#include "debuglog.h"
+
+#include <QString>
+
+static PCSCBackend *createBackend() {
+    if (qEnvironmentVariableIsSet("WEB_EID_REPLAY_PCSC")) {
+        QString path = QString::fromLocal8Bit(qgetenv("WEB_EID_REPLAY_PCSC"));
+        ReplayPCSCBackend *backend = new ReplayPCSCBackend();
+        if (backend->replay(path, qEnvironmentVariableIsSet("WEB_EID_REPLAY_FAST"))) {
+            _log("Replaying PC/SC sessions from %s", qPrintable(path));
+            return backend;
+        }
+        _log("Could not load recorded sessions from %s, using system PC/SC", qPrintable(path));
+        delete backend;
+    }
+    if (qEnvironmentVariableIsSet("WEB_EID_VIRTUAL_PCSC")) {
+        QString script = QString::fromLocal8Bit(qgetenv("WEB_EID_VIRTUAL_PCSC"));
+        VirtualPCSCBackend *backend = new VirtualPCSCBackend();
+        if (backend->load(script)) {
+            _log("Using virtual PC/SC from %s", qPrintable(script));
+            return backend;
+        }
+        _log("Could not load virtual PC/SC script %s, using system PC/SC", qPrintable(script));
+        delete backend;
+    }
+    return new SystemPCSCBackend();
+}
+
+// Lives as long as the process does
+PCSCBackend *PCSCBackend::instance() {
+    static PCSCBackend *backend = createBackend();
+    return backend;
+}
+
+LONG SystemPCSCBackend::EstablishContext(DWORD scope, LPCVOID reserved1, LPCVOID reserved2, SCARDCONTEXT *context) {
+    return SCardEstablishContext(scope, reserved1, reserved2, context);
+}
+
+LONG SystemPCSCBackend::ReleaseContext(SCARDCONTEXT context) {
+    return SCardReleaseContext(context);
+}
+
+LONG SystemPCSCBackend::ListReaders(SCARDCONTEXT context, LPCSTR groups, LPSTR readers, DWORD *size) {
+    return SCardListReaders(context, groups, readers, size);
+}
+
+LONG SystemPCSCBackend::GetStatusChange(SCARDCONTEXT context, DWORD timeout, SCARD_READERSTATE *states, DWORD count) {
+    return SCardGetStatusChange(context, timeout, states, count);
+}
+
+LONG SystemPCSCBackend::Cancel(SCARDCONTEXT context) {
+    return SCardCancel(context);
+}
+
+LONG SystemPCSCBackend::Connect(SCARDCONTEXT context, LPCSTR reader, DWORD mode, DWORD protocols, SCARDHANDLE *card, DWORD *protocol) {
+    return SCardConnect(context, reader, mode, protocols, card, protocol);
+}
+
+LONG SystemPCSCBackend::Reconnect(SCARDHANDLE card, DWORD mode, DWORD protocols, DWORD initialization, DWORD *protocol) {
+    return SCardReconnect(card, mode, protocols, initialization, protocol);
+}
+
+LONG SystemPCSCBackend::Disconnect(SCARDHANDLE card, DWORD disposition) {
+    return SCardDisconnect(card, disposition);
+}
+
+LONG SystemPCSCBackend::BeginTransaction(SCARDHANDLE card) {
+    return SCardBeginTransaction(card);
+}
+
+LONG SystemPCSCBackend::EndTransaction(SCARDHANDLE card, DWORD disposition) {
+    return SCardEndTransaction(card, disposition);
+}
+
+LONG SystemPCSCBackend::Status(SCARDHANDLE card, LPSTR name, DWORD *namelen, DWORD *state, DWORD *protocol, unsigned char *atr, DWORD *atrlen) {
+    return SCardStatus(card, name, namelen, state, protocol, atr, atrlen);
+}
+
+LONG SystemPCSCBackend::Transmit(SCARDHANDLE card, const SCARD_IO_REQUEST *sendpci, const unsigned char *send, DWORD sendlen,
+                                 SCARD_IO_REQUEST *recvpci, unsigned char *recv, DWORD *recvlen) {
+    return SCardTransmit(card, sendpci, send, sendlen, recvpci, recv, recvlen);
+}
@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2017 Martin Paljak
+ */
+
+#pragma once
+
+#ifdef __APPLE__
+#include <PCSC/winscard.h>
+#include <PCSC/wintypes.h>
+#else
+#undef UNICODE
+#include <winscard.h>
+#endif
+
+// The subset of the PC/SC API that the app uses. Every method mirrors the
+// SCard*() function with the same name, including the return values.
+// QtPCSC and friends talk to the instance() via the SCard() macro.
+class PCSCBackend {
+public:
+    virtual ~PCSCBackend() {}
+
+    virtual LONG EstablishContext(DWORD scope, LPCVOID reserved1, LPCVOID reserved2, SCARDCONTEXT *context) = 0;
+    virtual LONG ReleaseContext(SCARDCONTEXT context) = 0;
+    virtual LONG ListReaders(SCARDCONTEXT context, LPCSTR groups, LPSTR readers, DWORD *size) = 0;
+    virtual LONG GetStatusChange(SCARDCONTEXT context, DWORD timeout, SCARD_READERSTATE *states, DWORD count) = 0;
+    virtual LONG Cancel(SCARDCONTEXT context) = 0;
+
+    virtual LONG Connect(SCARDCONTEXT context, LPCSTR reader, DWORD mode, DWORD protocols, SCARDHANDLE *card, DWORD *protocol) = 0;
+    virtual LONG Reconnect(SCARDHANDLE card, DWORD mode, DWORD protocols, DWORD initialization, DWORD *protocol) = 0;
+    virtual LONG Disconnect(SCARDHANDLE card, DWORD disposition) = 0;
+    virtual LONG BeginTransaction(SCARDHANDLE card) = 0;
+    virtual LONG EndTransaction(SCARDHANDLE card, DWORD disposition) = 0;
+    virtual LONG Status(SCARDHANDLE card, LPSTR name, DWORD *namelen, DWORD *state, DWORD *protocol, unsigned char *atr, DWORD *atrlen) = 0;
+    virtual LONG Transmit(SCARDHANDLE card, const SCARD_IO_REQUEST *sendpci, const unsigned char *send, DWORD sendlen,
+                          SCARD_IO_REQUEST *recvpci, unsigned char *recv, DWORD *recvlen) = 0;
+
+    // The backend of the app, chosen on first use:
+    // - WEB_EID_REPLAY_PCSC=<session.json or folder> replays recorded sessions,
+    //   with WEB_EID_REPLAY_FAST set without the recorded timing
+    // - WEB_EID_VIRTUAL_PCSC=<script.json> selects the in-process virtual readers
+    // - otherwise the PC/SC library of the system is used
+    static PCSCBackend *instance();
+};
+
+// Passes everything to the PC/SC library of the system
+class SystemPCSCBackend: public PCSCBackend {
+public:
+    LONG EstablishContext(DWORD scope, LPCVOID reserved1, LPCVOID reserved2, SCARDCONTEXT *context) override;
+    LONG ReleaseContext(SCARDCONTEXT context) override;
+    LONG ListReaders(SCARDCONTEXT context, LPCSTR groups, LPSTR readers, DWORD *size) override;
+    LONG GetStatusChange(SCARDCONTEXT context, DWORD timeout, SCARD_READERSTATE *states, DWORD count) override;
+    LONG Cancel(SCARDCONTEXT context) override;
+
+    LONG Connect(SCARDCONTEXT context, LPCSTR reader, DWORD mode, DWORD protocols, SCARDHANDLE *card, DWORD *protocol) override;
+    LONG Reconnect(SCARDHANDLE card, DWORD mode, DWORD protocols, DWORD initialization, DWORD *protocol) override;
+    LONG Disconnect(SCARDHANDLE card, DWORD disposition) override;
+    LONG BeginTransaction(SCARDHANDLE card) override;
+    LONG EndTransaction(SCARDHANDLE card, DWORD disposition) override;
+    LONG Status(SCARDHANDLE card, LPSTR name, DWORD *namelen, DWORD *state, DWORD *protocol, unsigned char *atr, DWORD *atrlen) override;
+    LONG Transmit(SCARDHANDLE card, const SCARD_IO_REQUEST *sendpci, const unsigned char *send, DWORD sendlen,
+                  SCARD_IO_REQUEST *recvpci, unsigned char *recv, DWORD *recvlen) override;
+};
@@ -0,0 +1,91 @@
+/*
+ * Copyright (C) 2017 Martin Paljak
+ */
+
+#include "pcscrecorder.h"
+
+#include "debuglog.h"
+
+#include <QDateTime>
+#include <QDir>
+#include <QFile>
+#include <QJsonDocument>
+#include <QRegExp>
+#include <QSettings>
+#include <QStandardPaths>
+
+bool PCSCRecorder::isPINCommand(const QByteArray &apdu) {
+    if (apdu.size() <= 5) {
+        return false;
+    }
+    switch ((unsigned char)apdu.at(1)) {
+    case 0x20:
+    case 0x21:
+    case 0x24:
+    case 0x2C:
+        return true;
+    default:
+        return false;
+    }
+}
+
+QString PCSCRecorder::getSessionPath() {
+    return QDir(QStandardPaths::writableLocation(QStandardPaths::DesktopLocation)).filePath("web-eid-sessions");
+}
+
+PCSCRecorder *PCSCRecorder::start(const QString &reader, const QByteArray &atr, const QString &protocol) {
+    QSettings settings;
+    if (!settings.value("recordPCSC", false).toBool()) {
+        return nullptr;
+    }
+    return new PCSCRecorder(reader, atr, protocol);
+}
+
+PCSCRecorder::PCSCRecorder(const QString &reader, const QByteArray &atr, const QString &protocol): reader(reader) {
+    session["reader"] = reader;
+    session["atr"] = QString(atr.toHex());
+    session["protocol"] = protocol;
+    session["recorded"] = QDateTime::currentDateTime().toString(Qt::ISODate);
+    clock.start();
+}
+
+void PCSCRecorder::exchange(const QByteArray &apdu, const QByteArray &response, qint64 ms) {
+    QJsonObject e;
+    if (isPINCommand(apdu)) {
+        e["apdu"] = QString((apdu.left(5) + QByteArray(apdu.size() - 5, char(0xFF))).toHex());
+        e["masked"] = true;
+    } else {
+        e["apdu"] = QString(apdu.toHex());
+    }
+    e["response"] = QString(response.toHex());
+    e["ms"] = ms;
+    exchanges.append(e);
+}
+
+void PCSCRecorder::reset(const QByteArray &atr, const QString &protocol) {
+    QJsonObject e;
+    e["reset"] = true;
+    e["atr"] = QString(atr.toHex());
+    e["protocol"] = protocol;
+    exchanges.append(e);
+}
+
+PCSCRecorder::~PCSCRecorder() {
+    session["exchanges"] = exchanges;
+    session["duration"] = clock.elapsed();
+
+    QDir dir(getSessionPath());
+    if (!dir.mkpath(".")) {
+        _log("Could not create %s", qPrintable(dir.path()));
+        return;
+    }
+    QString name = reader;
+    name.replace(QRegExp("[^A-Za-z0-9_-]+"), "_");
+    QFile f(dir.filePath(QStringLiteral("%1-%2.json").arg(QDateTime::currentDateTime().toString("yyyyMMdd-hhmmsszzz"), name)));
+    if (!f.open(QIODevice::WriteOnly)) {
+        _log("Could not write %s", qPrintable(f.fileName()));
+        return;
+    }
+    f.write(QJsonDocument(session).toJson());
+    _log("Recorded %d exchanges with %s to %s", exchanges.size(), qPrintable(reader), qPrintable(f.fileName()));
+}
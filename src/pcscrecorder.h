@@ -0,0 +1,53 @@
+/*
+ * Copyright (C) 2017 Martin Paljak
+ */
+
+#pragma once
+
+#include <QByteArray>
+#include <QElapsedTimer>
+#include <QJsonArray>
+#include <QJsonObject>
+#include <QString>
+
+/*
+Records a card session of QPCSCReaderWorker (ATR, protocol and every APDU
+with its response and transmit time) for replaying with ReplayPCSCBackend.
+Enabled with the "recordPCSC" setting. Every session is saved as a JSON file
+to the web-eid-sessions folder on the desktop, next to the debug log:
+
+{
+  "reader": "ACS ACR38U-CCID 00 00",
+  "atr": "3BFE...", "protocol": "T=1",
+  "exchanges": [
+    {"apdu": "00A4040C...", "response": "9000", "ms": 12},
+    {"reset": true, "atr": "3BFE...", "protocol": "T=1"},
+    {"apdu": "00200001...", "response": "9000", "ms": 80, "masked": true}
+  ]
+}
+
+The data of PIN commands is overwritten with FF bytes and marked as "masked".
+*/
+class PCSCRecorder {
+public:
+    // Returns nullptr if recording is not enabled
+    static PCSCRecorder *start(const QString &reader, const QByteArray &atr, const QString &protocol);
+    // Saves the session
+    ~PCSCRecorder();
+
+    void exchange(const QByteArray &apdu, const QByteArray &response, qint64 ms);
+    // After the card was reconnected with a reset
+    void reset(const QByteArray &atr, const QString &protocol);
+
+    static QString getSessionPath();
+    // VERIFY, CHANGE REFERENCE DATA, RESET RETRY COUNTER and friends carry PIN-s
+    static bool isPINCommand(const QByteArray &apdu);
+
+private:
+    PCSCRecorder(const QString &reader, const QByteArray &atr, const QString &protocol);
+
+    QString reader;
+    QJsonObject session;
+    QJsonArray exchanges;
+    QElapsedTimer clock;
+};
@@ -11,7 +11,7 @@
 #include <string>
 #include <stdexcept>
 #include <iostream>
-#include <map>
+#include <unordered_map>
 #include <set>
 #include <vector>
 
@@ -190,8 +190,8 @@ CK_RV PKCS11Module::refresh() {
 
 }
 
-std::map<std::vector <unsigned char>, P11Token> PKCS11Module::getCerts() {
-    std::map<std::vector<unsigned char>, P11Token> res;
+std::unordered_map<std::vector<unsigned char>, P11Token, BytesHash> PKCS11Module::getCerts() {
+    std::unordered_map<std::vector<unsigned char>, P11Token, BytesHash> res;
     for(auto const &crts: certs) {
         _log("returning certificate: %s", x509subject(crts.first).c_str());
         res.insert(std::make_pair(crts.first, crts.second.first));
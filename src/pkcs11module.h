@@ -6,7 +6,7 @@
 
 #include <vector>
 #include <string>
-#include <map>
+#include <unordered_map>
 
 #include "pkcs11.h"
 #include "webeid.h"
@@ -26,6 +26,17 @@ struct P11Token {
     std::string module; // name of module
 };
 
+// FNV-1a, to use certificates as keys of unordered maps
+struct BytesHash {
+    size_t operator()(const std::vector<unsigned char> &bytes) const {
+        size_t h = 2166136261u;
+        for (unsigned char b: bytes) {
+            h = (h ^ b) * 16777619u;
+        }
+        return h;
+    }
+};
+
 class PKCS11Module {
 public:
     CK_RV load(const std::string &module);
@@ -37,7 +48,7 @@ public:
     bool isLoaded() {
         return !certs.empty();
     }
-    std::map<std::vector <unsigned char>, P11Token> getCerts();
+    std::unordered_map<std::vector<unsigned char>, P11Token, BytesHash> getCerts();
 
     const P11Token getP11Token(const std::vector<unsigned char> &cert) const;
 
@@ -63,7 +74,7 @@ private:
 
     // Contains all the certificates this module exposes
     // der maps to a pair of slot id and object id
-    std::map<std::vector<unsigned char>, std::pair<P11Token, std::vector<unsigned char>>> certs;
+    std::unordered_map<std::vector<unsigned char>, std::pair<P11Token, std::vector<unsigned char>>, BytesHash> certs;
 
     // locates the key handle for the key with the given ID
     std::vector<CK_OBJECT_HANDLE> getKey(CK_SESSION_HANDLE session, const std::vector<unsigned char> &id) const;
@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2017 Martin Paljak
+ */
+
+#include "protocolcache.h"
+
+#include "debuglog.h"
+
+#include <QMutex>
+#include <QMutexLocker>
+#include <QSettings>
+
+static QMutex mutex; // Guards the counters
+static int hits = 0;
+static int misses = 0;
+static int fallbacks = 0;
+
+static QString key(const QByteArray &atr) {
+    return QStringLiteral("protocols/%1").arg(QString(atr.toHex()));
+}
+
+DWORD ProtocolCache::lookup(const QByteArray &atr) {
+    if (atr.isEmpty()) {
+        return 0;
+    }
+    QSettings settings;
+    DWORD protocol = settings.value(key(atr), 0).toUInt();
+    QMutexLocker locker(&mutex);
+    if (protocol == SCARD_PROTOCOL_T0 || protocol == SCARD_PROTOCOL_T1) {
+        hits++;
+    } else {
+        protocol = 0;
+        misses++;
+    }
+    _log("Protocol cache %s for %s (%d hits, %d misses, %d fallbacks)", protocol ? "hit" : "miss", qPrintable(atr.toHex()), hits, misses, fallbacks);
+    return protocol;
+}
+
+void ProtocolCache::store(const QByteArray &atr, DWORD protocol) {
+    if (atr.isEmpty() || (protocol != SCARD_PROTOCOL_T0 && protocol != SCARD_PROTOCOL_T1)) {
+        return;
+    }
+    QSettings settings;
+    if (settings.value(key(atr), 0).toUInt() != protocol) {
+        settings.setValue(key(atr), uint(protocol));
+    }
+}
+
+void ProtocolCache::forget(const QByteArray &atr) {
+    QSettings settings;
+    settings.remove(key(atr));
+    QMutexLocker locker(&mutex);
+    fallbacks++;
+    _log("Cached protocol did not work for %s, negotiating", qPrintable(atr.toHex()));
+}
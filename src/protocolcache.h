@@ -0,0 +1,22 @@
+/*
+ * Copyright (C) 2017 Martin Paljak
+ */
+
+#pragma once
+
+#include "pcscbackend.h"
+
+#include <QByteArray>
+
+// Remembers the protocol that cards with a given ATR settle on, so that
+// wildcard connects can offer only that protocol and skip the negotiation.
+// Stored in the "protocols" group of settings, with the ATR in hex as key.
+// Safe to use from any thread.
+namespace ProtocolCache {
+// The protocol to offer for a wildcard connect, 0 if not known
+DWORD lookup(const QByteArray &atr);
+// The protocol that the card settled on after a wildcard connect
+void store(const QByteArray &atr, DWORD protocol);
+// The cached protocol did not work out
+void forget(const QByteArray &atr);
+}
@@ -5,6 +5,8 @@
 #include "qpcsc.h"
 
 #include "util.h"
+#include "protocolcache.h"
+#include "responsecache.h"
 
 #include <set>
 #include <map>
@@ -19,6 +21,8 @@
 #include <QJsonDocument>
 #include <QMutexLocker>
 #include <QTime>
+#include <QElapsedTimer>
+#include <QSettings>
 
 #include "dialogs/reader_in_use.h"
 #include "dialogs/insert_card.h"
@@ -42,17 +46,21 @@ Signals emitted happen in the following order
 - cardRemoved
 - readerAvailable
 
+Events of the worker are coalesced in the main thread: a burst of events
+within "pcscEventCoalesce" milliseconds (default 50, 0 disables) becomes a
+single net change per reader, so that dialogs and QPKI are updated once.
 */
 
+// All PC/SC calls go through the active backend
 template <typename Func, typename... Args>
 LONG SCCall(const char *fun, const char *file, int line, const char *function, Func func, Args... args)
 {
     // TODO: log parameters
-    LONG err = func(args...);
+    LONG err = (PCSCBackend::instance()->*func)(args...);
     Logger::writeLog(fun, file, line, "%s: %s (0x%08x)", function, QtPCSC::errorName(err), err);
     return err;
 }
-#define SCard(API, ...) SCCall(__FUNCTION__, __FILE__, __LINE__, "SCard" #API, SCard##API, __VA_ARGS__)
+#define SCard(API, ...) SCCall(__FUNCTION__, __FILE__, __LINE__, "SCard" #API, &PCSCBackend::API, __VA_ARGS__)
 
 
 // List taken from pcsc-lite source
@@ -100,6 +108,7 @@ const char *QtPCSC::errorName(LONG err)
         CASE(SCARD_E_NO_SERVICE);
         CASE(SCARD_E_SERVICE_STOPPED);
         CASE(SCARD_E_NO_READERS_AVAILABLE);
+        CASE(SCARD_E_NO_ACCESS);
     default:
         return "UNKNOWN";
     };
@@ -159,7 +168,9 @@ void QPCSCEventWorker::start() {
 
         if ((rv == LONG(SCARD_E_TIMEOUT)) && (state.dwEventState & SCARD_STATE_UNKNOWN)) {
             _log("No PnP support");
+            mutex.lock();
             pnp = false;
+            mutex.unlock();
         }
         // Wait for events and emit them.
         rv = generate();
@@ -225,6 +236,9 @@ LONG QPCSCEventWorker::generate()
     do {
         std::vector<SCARD_READERSTATE> statuses;
         bool change = false;
+        if (relist.testAndSetOrdered(1, 0)) {
+            list = true;
+        }
         if (list)  {
             // List readers
             readernames.clear();
@@ -311,6 +325,14 @@ LONG QPCSCEventWorker::generate()
 
         // Query statuses
         rv = SCard(GetStatusChange, context, 600000, &statuses[0], DWORD(statuses.size())); // FIXME: magic constant
+        if (rv == LONG(SCARD_E_CANCELLED) && !stopping.loadAcquire()) {
+            // Woken up by the hotplug monitor, also if the wake-up was
+            // already taken at the top of the loop
+            relist = 0;
+            list = true;
+            rv = SCARD_S_SUCCESS;
+            continue;
+        }
         if (rv == LONG(SCARD_E_UNKNOWN_READER)) {
             // List changed while in air, try again
             list = true;
@@ -395,6 +417,30 @@ void QtPCSC::cancel() {
     SCard(Cancel, worker.getContext());
 }
 
+void QPCSCEventWorker::wake() {
+    relist = 1;
+    SCard(Cancel, getContext());
+}
+
+void QtPCSC::hotplug(const QString &action, const QString &device) {
+    (void)device;
+    if (action == "add") {
+        plugged.start();
+    }
+    // With PnP PC/SC notices by itself
+    if (!wakeOnHotplug || worker.hasPnP()) {
+        return;
+    }
+    // The PC/SC service picks up the reader a bit later, so look again in a while
+    worker.wake();
+    QTimer::singleShot(500, this, [this] {
+        worker.wake();
+    });
+    QTimer::singleShot(2000, this, [this] {
+        worker.wake();
+    });
+}
+
 QMap<QString, QPair<QByteArray, QStringList>> QPCSCEventWorker::getReaders() {
     QMutexLocker locker(&mutex);
     QMap<QString, QPair<QByteArray, QStringList>> result;
@@ -409,6 +455,126 @@ QMap<QString, QPair<QByteArray, QStringList>> QtPCSC::getReaders() {
     return worker.getReaders();
 }
 
+// Delta of a reader, created with the state before the burst
+QtPCSC::Delta &QtPCSC::delta(const QString &reader, bool known, bool card) {
+    if (!pending.contains(reader)) {
+        Delta &d = pending[reader];
+        d.knownBefore = d.known = known;
+        d.cardBefore = d.card = card;
+    }
+    return pending[reader];
+}
+
+void QtPCSC::queueCardInserted(const QString &reader, const QByteArray &atr, const QStringList flags) {
+    Delta &d = delta(reader, true, false);
+    d.card = true;
+    d.atr = atr;
+    d.flags = flags;
+    schedule();
+}
+
+void QtPCSC::queueCardRemoved(const QString &reader) {
+    Delta &d = delta(reader, true, true);
+    d.card = false;
+    d.cardOut = true;
+    d.atr.clear();
+    d.flags.clear();
+    schedule();
+}
+
+void QtPCSC::queueReaderAttached(const QString &name) {
+    Delta &d = delta(name, false, false);
+    d.known = true;
+    schedule();
+}
+
+void QtPCSC::queueReaderRemoved(const QString &name) {
+    Delta &d = delta(name, true, false);
+    d.known = false;
+    d.detached = true;
+    d.card = false;
+    schedule();
+}
+
+void QtPCSC::queueReaderChanged(const QString &reader, const QByteArray &atr, const QStringList flags) {
+    Delta &d = delta(reader, true, flags.contains("PRESENT"));
+    d.changed = true;
+    d.atr = atr;
+    d.flags = flags;
+    schedule();
+}
+
+void QtPCSC::queueReaderListChanged(const QMap<QString, QPair<QByteArray, QStringList>> &readers) {
+    listChanged = true;
+    lastList = readers;
+    schedule();
+}
+
+void QtPCSC::schedule() {
+    if (window <= 0) {
+        return flush();
+    }
+    if (!burst.isValid()) {
+        burst.start();
+    }
+    // A steady stream of events must not starve the subscribers
+    if (burst.elapsed() >= 4 * window) {
+        return flush();
+    }
+    coalesce.start(window);
+}
+
+// Emit the net changes in the documented order
+void QtPCSC::flush() {
+    coalesce.stop();
+    burst.invalidate();
+    QMap<QString, Delta> deltas;
+    deltas.swap(pending);
+    bool list = listChanged;
+    listChanged = false;
+    _log("Emitting coalesced changes of %d readers", deltas.size());
+
+    // Readers that were present before but removed since, with their cards
+    for (auto i = deltas.begin(); i != deltas.end(); ++i) {
+        Delta &d = i.value();
+        if (d.knownBefore && d.detached) {
+            if (d.cardBefore && d.cardOut) {
+                emit cardRemoved(i.key());
+                d.cardBefore = false;
+            }
+            emit readerRemoved(i.key());
+        }
+    }
+    // New readers, also re-attached ones. Readers that came and went are not reported
+    for (auto i = deltas.constBegin(); i != deltas.constEnd(); ++i) {
+        if (i.value().known && (!i.value().knownBefore || i.value().detached)) {
+            if (plugged.isValid()) {
+                _log("Reader attach latency %lld ms (%s)", (long long)plugged.elapsed(), wakeOnHotplug ? "wake" : "observe");
+                plugged.invalidate();
+            }
+            emit readerAttached(i.key());
+        }
+    }
+    if (list) {
+        emit readerListChanged(lastList);
+    }
+    // Cards of present readers. A replaced card is removed and inserted
+    for (auto i = deltas.constBegin(); i != deltas.constEnd(); ++i) {
+        const Delta &d = i.value();
+        if (!d.known) {
+            continue;
+        }
+        if (d.cardBefore && d.cardOut) {
+            emit cardRemoved(i.key());
+        }
+        if (d.card && (!d.cardBefore || d.cardOut)) {
+            emit cardInserted(i.key(), d.atr, d.flags);
+        } else if (d.changed) {
+            emit readerChanged(i.key(), d.atr, d.flags);
+        }
+    }
+}
+
 QPCSCReader *QtPCSC::connectReader(WebContext *webcontext, const QString &reader, const QString &protocol, bool wait) {
     _log("connecting to %s", qPrintable(reader));
     auto rdrs = getReaders();
@@ -418,7 +584,9 @@ QPCSCReader *QtPCSC::connectReader(WebContext *webcontext, const QString &reader
         return nullptr;
     }
 
-    QPCSCReader *result = new QPCSCReader(webcontext, this, reader, protocol);
+    QSettings settings;
+    bool shared = settings.value("sharedReaders", false).toBool();
+    QPCSCReader *result = new QPCSCReader(webcontext, this, reader, protocol, shared);
 
     connect(this, &QtPCSC::readerRemoved, result, &QPCSCReader::readerRemoved, Qt::QueuedConnection);
 
@@ -437,39 +605,212 @@ QPCSCReader *QtPCSC::connectReader(WebContext *webcontext, const QString &reader
     return result;
 }
 
+// Readers that some origin has chosen to remember
+static bool isRemembered(const QString &reader) {
+    QSettings settings;
+    for (const auto &group: settings.childGroups()) {
+        if (settings.value(QStringLiteral("%1/reader").arg(group)).toString() == reader) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Connect to a freshly inserted card before the site asks for it
+void QtPCSC::warmUp(const QString &reader, const QByteArray &atr, const QStringList &flags) {
+    (void)atr;
+    QSettings settings;
+    if (!settings.value("preconnect", false).toBool() || settings.value("sharedReaders", false).toBool()) {
+        return;
+    }
+    if (warm.contains(reader) || flags.contains("MUTE") || flags.contains("EXCLUSIVE") || !isRemembered(reader)) {
+        return;
+    }
+    _log("Warming up connection to %s", qPrintable(reader));
+    Warm w;
+    w.thread = new QThread();
+    w.worker = new QPCSCReaderWorker();
+    w.expiry = new QTimer(this);
+    w.thread->start();
+    w.worker->moveToThread(w.thread);
+    // Unused and failed connections are released
+    w.expiry->setSingleShot(true);
+    connect(w.expiry, &QTimer::timeout, this, [this, reader] {
+        _log("Warm connection to %s was not used", qPrintable(reader));
+        release(reader);
+    });
+    w.expiry->start(settings.value("preconnectTimeout", 10000).toInt());
+    warm[reader] = w;
+    QMetaObject::invokeMethod(w.worker, "warmCard", Qt::QueuedConnection, Q_ARG(QString, reader));
+}
+
+void QtPCSC::release(const QString &reader) {
+    if (!warm.contains(reader)) {
+        return;
+    }
+    _log("Releasing warm connection to %s", qPrintable(reader));
+    Warm w = warm.take(reader);
+    w.expiry->deleteLater();
+    QObject::disconnect(w.worker, nullptr, this, nullptr);
+    // The worker disconnects in its own thread
+    connect(w.thread, &QThread::finished, w.worker, &QObject::deleteLater);
+    connect(w.thread, &QThread::finished, w.thread, &QObject::deleteLater);
+    w.thread->quit();
+}
+
+// Any reader that opens takes the warm connection, so that the two do not
+// race for the card. A QPCSCReader is opened when connecting and again by
+// the insert card dialog.
+void QtPCSC::handOver(QPCSCReader *reader) {
+    if (!warm.contains(reader->name)) {
+        return;
+    }
+    _log("Using warm connection to %s", qPrintable(reader->name));
+    Warm w = warm.take(reader->name);
+    w.expiry->deleteLater();
+    reader->adopt(w.thread, w.worker);
+}
+
+QPCSCSession *QtPCSC::openSession(const QString &reader, const QString &origin) {
+    if (!schedulers.contains(reader)) {
+        QThread *t = new QThread(this);
+        QPCSCScheduler *scheduler = new QPCSCScheduler(reader);
+        scheduler->moveToThread(t);
+        connect(t, &QThread::finished, scheduler, &QObject::deleteLater);
+        t->start();
+        schedulers[reader] = scheduler;
+    }
+    QPCSCSession *session = new QPCSCSession(schedulers[reader], origin);
+    session->moveToThread(schedulers[reader]->thread());
+    return session;
+}
+
 // Reader
+QPCSCReader::QPCSCReader(WebContext *webcontext, QtPCSC *pcsc, const QString &name, const QString &proto, bool shared): QObject(webcontext), name(name), PCSC(pcsc), protocol(proto) {
+    setObjectName(name);
+    if (shared) {
+        thread = nullptr;
+        worker = pcsc->openSession(name, webcontext->friendlyOrigin());
+    } else {
+        thread = new QThread();
+        worker = new QPCSCReaderWorker();
+    }
+    deadline.setSingleShot(true);
+    connect(&deadline, &QTimer::timeout, this, &QPCSCReader::expired);
+}
+
+QPCSCReader::~QPCSCReader() {
+    if (!thread) {
+        // The session lives in the thread of the scheduler
+        worker->deleteLater();
+    } else if (thread->isRunning()) {
+        // Never wait for the worker here, it might be stuck in a blocking call.
+        // The worker is deleted in its own thread once the event loop exits.
+        connect(thread, &QThread::finished, worker, &QObject::deleteLater);
+        connect(thread, &QThread::finished, thread, &QObject::deleteLater);
+        thread->quit();
+    } else {
+        delete worker;
+        delete thread;
+    }
+}
+
+void QPCSCReader::adopt(QThread *thread, QPCSCReaderWorker *worker) {
+    delete this->worker;
+    delete this->thread;
+    this->thread = thread;
+    this->worker = worker;
+    adopted = true;
+}
+
 void QPCSCReader::open() {
-    // Start the thread
-    thread.start();
-    worker.moveToThread(&thread);
+    if (thread && !adopted) {
+        PCSC->handOver(this);
+    }
+    // Start the thread, shared sessions and adopted workers already have one
+    if (thread && !adopted) {
+        thread->start();
+        worker->moveToThread(thread);
+    }
 
     // control signals
-    connect(this, &QPCSCReader::connectCard, &worker, &QPCSCReaderWorker::connectCard, Qt::QueuedConnection);
-    connect(this, &QPCSCReader::reconnectCard, &worker, &QPCSCReaderWorker::reconnectCard, Qt::QueuedConnection);
-    connect(this, &QPCSCReader::disconnectCard, &worker, &QPCSCReaderWorker::disconnectCard, Qt::QueuedConnection);
-    connect(this, &QPCSCReader::transmitBytes, &worker, &QPCSCReaderWorker::transmit, Qt::QueuedConnection);
+    connect(this, &QPCSCReader::connectCard, worker, &QPCSCReaderWorker::connectCard, Qt::QueuedConnection);
+    connect(this, &QPCSCReader::reconnectCard, worker, &QPCSCReaderWorker::reconnectCard, Qt::QueuedConnection);
+    connect(this, &QPCSCReader::disconnectCard, worker, &QPCSCReaderWorker::disconnectCard, Qt::QueuedConnection);
+    connect(this, &QPCSCReader::transmitBytes, worker, &QPCSCReaderWorker::transmit, Qt::QueuedConnection);
+    connect(this, &QPCSCReader::claimCard, worker, &QPCSCReaderWorker::claimCard, Qt::QueuedConnection);
 
     connect(PCSC, &QtPCSC::cardRemoved, this, &QPCSCReader::readerRemoved, Qt::QueuedConnection);
 
+    // Any answer from the worker disarms the watchdog
+    connect(worker, &QPCSCReaderWorker::disconnected, &deadline, &QTimer::stop, Qt::QueuedConnection);
+    connect(worker, &QPCSCReaderWorker::connected, &deadline, &QTimer::stop, Qt::QueuedConnection);
+    connect(worker, &QPCSCReaderWorker::reconnected, &deadline, &QTimer::stop, Qt::QueuedConnection);
+    connect(worker, &QPCSCReaderWorker::received, &deadline, &QTimer::stop, Qt::QueuedConnection);
+
     // proxy signals
-    connect(&worker, &QPCSCReaderWorker::disconnected, this, &QPCSCReader::disconnected, Qt::QueuedConnection);
-    connect(&worker, &QPCSCReaderWorker::connected, this, &QPCSCReader::connected, Qt::QueuedConnection);
-    connect(&worker, &QPCSCReaderWorker::reconnected, this, &QPCSCReader::reconnected, Qt::QueuedConnection);
-    connect(&worker, &QPCSCReaderWorker::received, this, &QPCSCReader::received, Qt::QueuedConnection);
+    connect(worker, &QPCSCReaderWorker::disconnected, this, &QPCSCReader::disconnected, Qt::QueuedConnection);
+    connect(worker, &QPCSCReaderWorker::connected, this, &QPCSCReader::connected, Qt::QueuedConnection);
+    connect(worker, &QPCSCReaderWorker::reconnected, this, &QPCSCReader::reconnected, Qt::QueuedConnection);
+    connect(worker, &QPCSCReaderWorker::received, this, &QPCSCReader::received, Qt::QueuedConnection);
 
     // Open the "in use"" dialog.
-    connect(&worker, &QPCSCReaderWorker::connected, this, [=] {
+    connect(worker, &QPCSCReaderWorker::connected, this, [=] {
         isOpen = true;
         WebContext *ctx = static_cast<WebContext *>(parent());
         QtReaderInUse *inusedlg = new QtReaderInUse(ctx->friendlyOrigin(), name);
-        connect(inusedlg, &QDialog::rejected, &worker, &QPCSCReaderWorker::disconnectCard, Qt::QueuedConnection);
-        // And close the dialog if reader is disconnected
-        connect(&worker, &QPCSCReaderWorker::disconnected, inusedlg, &QDialog::accept, Qt::QueuedConnection);
+        connect(inusedlg, &QDialog::rejected, this, &QPCSCReader::disconnect);
+        // And close the dialog if reader is disconnected, also by the watchdog
+        connect(this, &QPCSCReader::disconnected, inusedlg, &QDialog::accept, Qt::QueuedConnection);
         connect(ctx, &WebContext::disconnected, inusedlg, &QDialog::reject);
     }, Qt::QueuedConnection);
 
     // connect in thread
-    emit connectCard(name, protocol);
+    arm("connect", 30000);
+    if (adopted) {
+        emit claimCard(protocol);
+    } else {
+        emit connectCard(name, protocol);
+    }
+}
+
+// Start the watchdog for a worker command. Timeouts are configurable
+// per operation, in milliseconds, 0 disables the watchdog.
+void QPCSCReader::arm(const QString &operation, int msec) {
+    QSettings settings;
+    int timeout = settings.value(QStringLiteral("timeouts/%1").arg(operation), msec).toInt();
+    if (timeout > 0) {
+        deadline.start(timeout);
+    } else {
+        deadline.stop();
+    }
+}
+
+// The only case where the card is reset behind a blocked worker
+void QPCSCReader::expired() {
+    _log("%s did not respond in time", qPrintable(name));
+    if (thread) {
+        worker->abandon();
+    }
+    abort(SCARD_E_TIMEOUT);
+}
+
+void QPCSCReader::abort(const LONG err) {
+    _log("Aborting %s: %s", qPrintable(name), QtPCSC::errorName(err));
+    deadline.stop();
+    // Results of the blocked call are not interesting any more
+    QObject::disconnect(worker, nullptr, this, nullptr);
+    QObject::disconnect(worker, nullptr, &deadline, nullptr);
+    QObject::disconnect(this, nullptr, worker, nullptr);
+    if (thread) {
+        // No context yet if the worker has not got to establish one
+        SCARDCONTEXT ctx = worker->getContext();
+        if (ctx) {
+            SCard(Cancel, ctx);
+        }
+    }
+    isOpen = false;
+    emit disconnected(err);
 }
 
 void QPCSCReader::cardInserted(const QString &reader, const QByteArray &atr, const QStringList &flags) {
@@ -490,19 +831,41 @@ void QPCSCReader::disconnect() {
     if (!isOpen) {
         return emit(disconnected(SCARD_E_CANCELLED));
     }
+    arm("disconnect", 10000);
     emit disconnectCard();
 }
 
 void QPCSCReader::transmit(const QByteArray &apdu) {
+    arm("transmit", 120000);
     emit transmitBytes(apdu);
 }
 
 void QPCSCReader::reconnect(const QString &protocol) {
+    arm("reconnect", 30000);
     emit reconnectCard(protocol);
 }
 
+// ATR of the card in a reader, without connecting to it
+static QByteArray currentATR(SCARDCONTEXT context, const QString &reader) {
+    QByteArray name = reader.toLatin1();
+    SCARD_READERSTATE state = {name.constData(), nullptr, SCARD_STATE_UNAWARE, SCARD_STATE_UNAWARE, 0, {0}};
+    LONG rv = SCard(GetStatusChange, context, 0, &state, DWORD(1));
+    if ((rv != SCARD_S_SUCCESS && rv != LONG(SCARD_E_TIMEOUT)) || !(state.dwEventState & SCARD_STATE_PRESENT)) {
+        return QByteArray();
+    }
+    return QByteArray((const char *)state.rgbAtr, int(state.cbAtr));
+}
+
+// A cached protocol can fail in many ways, sharing violations included.
+// Only a missing card says nothing about the protocol
+static bool isStaleProtocol(LONG rv) {
+    return rv != SCARD_S_SUCCESS && rv != LONG(SCARD_E_NO_SMARTCARD) && rv != LONG(SCARD_W_REMOVED_CARD);
+}
+
 // Worker
 QPCSCReaderWorker::~QPCSCReaderWorker() {
+    delete recorder;
+    delete cache;
     if (card) {
         SCard(Disconnect, card, SCARD_LEAVE_CARD);
     }
@@ -512,14 +875,57 @@ QPCSCReaderWorker::~QPCSCReaderWorker() {
     }
 }
 
+// SCardCancel() of pcsc-lite interrupts only SCardGetStatusChange(), a blocked
+// transmit or connect keeps the card until the driver returns. The handles are
+// used only in the thread of the worker, so the card is reset and the context
+// released here once the call returns, and the worker does nothing else after.
+// The thread is the worker's own, it is left to finish after the reader is gone.
+bool QPCSCReaderWorker::abandoned() {
+    if (!dropped.loadAcquire()) {
+        return false;
+    }
+    if (card) {
+        _log("Resetting abandoned connection to %s", qPrintable(name));
+        SCard(Disconnect, card, SCARD_RESET_CARD);
+        card = 0;
+    }
+    mutex.lock();
+    SCARDCONTEXT ctx = context;
+    context = 0;
+    mutex.unlock();
+    if (ctx) {
+        SCard(ReleaseContext, ctx);
+    }
+    delete cache;
+    cache = nullptr;
+    return true;
+}
+
 void QPCSCReaderWorker::connectCard(const QString &reader, const QString &protocol) {
     name = reader;
     LONG rv = SCARD_S_SUCCESS;
+    if (abandoned()) {
+        return;
+    }
+    mutex.lock();
+    SCARDCONTEXT ctx = context;
+    context = 0;
+    mutex.unlock();
+    if (ctx) {
+        // Fallback from claimCard()
+        SCard(ReleaseContext, ctx);
+    }
     // Context per thread, required by pcsc-lite
-    rv = SCard(EstablishContext, SCARD_SCOPE_USER, nullptr, nullptr, &context);
+    rv = SCard(EstablishContext, SCARD_SCOPE_USER, nullptr, nullptr, &ctx);
     if (rv != SCARD_S_SUCCESS) {
         return emit disconnected(rv);
     }
+    mutex.lock();
+    context = ctx;
+    mutex.unlock();
+    if (abandoned()) {
+        return;
+    }
 
     // protocol
     DWORD proto = SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1;
@@ -533,8 +939,25 @@ void QPCSCReaderWorker::connectCard(const QString &reader, const QString &protoc
         return emit disconnected(SCARD_E_INVALID_PARAMETER);
     }
 
+    // A wildcard connect offers only the protocol that this ATR settled on before
+    QByteArray cached;
+    if (protocol == "*") {
+        QByteArray current = currentATR(context, reader);
+        DWORD known = ProtocolCache::lookup(current);
+        if (known) {
+            proto = known;
+            cached = current;
+        }
+    }
+
     // Try to connect multiple times, a freshly inserted card is often probed by other software as well
     rv = SCard(Connect, context, reader.toLatin1().data(), mode, proto, &card, &this->protocol);
+    if (!cached.isEmpty() && isStaleProtocol(rv)) {
+        _log("Connect with cached protocol failed: %s", QtPCSC::errorName(rv));
+        ProtocolCache::forget(cached);
+        proto = SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1;
+        rv = SCard(Connect, context, reader.toLatin1().data(), mode, proto, &card, &this->protocol);
+    }
     if (rv == LONG(SCARD_E_SHARING_VIOLATION)) {
 #ifndef Q_OS_WIN
         // On Unix, we are happy with a shared connection + transaction
@@ -553,11 +976,14 @@ void QPCSCReaderWorker::connectCard(const QString &reader, const QString &protoc
             _log("Slept %d", a.msecsTo(QTime::currentTime()));
             i++;
             rv = SCard(Connect, context, reader.toLatin1().data(), mode, proto, &card, &this->protocol);
-        } while ((i < 10) && (rv == LONG(SCARD_E_SHARING_VIOLATION)));
+        } while ((i < 10) && (rv == LONG(SCARD_E_SHARING_VIOLATION)) && !dropped.loadAcquire());
 #endif
     }
 
     // Check
+    if (abandoned()) {
+        return;
+    }
     if (rv != SCARD_S_SUCCESS) {
         return emit disconnected(rv);
     }
@@ -570,27 +996,100 @@ void QPCSCReaderWorker::connectCard(const QString &reader, const QString &protoc
     QByteArray atr(33, 0);
     DWORD atrlen = atr.size();
     rv = SCard(Status, card, tmpname.data(), &tmplen, &tmpstate, &tmpproto, (unsigned char *) atr.data(), &atrlen);
+    if (abandoned()) {
+        return;
+    }
     if (rv != SCARD_S_SUCCESS) {
         return emit disconnected(rv);
     }
     atr.resize(atrlen);
     tmpname.resize(tmplen);
     _log("Current state of %s: %s, protocol %d, atr %s", tmpname.data(), qPrintable(readerStateNames(tmpstate).join(",")), tmpproto, qPrintable(atr.toHex()));
+    if (protocol == "*") {
+        ProtocolCache::store(atr, this->protocol);
+    }
+    this->atr = atr;
 
 #ifndef Q_OS_WIN
-    // Transactions on non-windows machines
-    rv = SCard(BeginTransaction, card);
-    if (rv != SCARD_S_SUCCESS) {
-        return emit disconnected(rv);
+    // Transactions on non-windows machines, once claimed
+    if (!warm) {
+        rv = SCard(BeginTransaction, card);
+        if (abandoned()) {
+            return;
+        }
+        if (rv != SCARD_S_SUCCESS) {
+            return emit disconnected(rv);
+        }
     }
 #endif
 
     _log("Connected to %s in %s mode, protocol %s", qPrintable(reader), mode == SCARD_SHARE_EXCLUSIVE ? "exclusive" : "shared", this->protocol == SCARD_PROTOCOL_T0 ? "T=0" : "T=1");
+    delete recorder;
+    recorder = PCSCRecorder::start(reader, atr, this->protocol == SCARD_PROTOCOL_T0 ? "T=0" : "T=1");
+    if (!warm) {
+        startCache();
+    }
     emit connected(atr, this->protocol == SCARD_PROTOCOL_T0 ? "T=0" : "T=1");
 }
 
+// Nothing is reported until claimCard(), neither the connection nor its
+// failure, the worker may already be wired to a reader
+void QPCSCReaderWorker::warmCard(const QString &reader) {
+    warm = true;
+    mode = SCARD_SHARE_SHARED;
+    blockSignals(true);
+    connectCard(reader, "*");
+    blockSignals(false);
+    if (card) {
+        _log("Warm connection to %s ready", qPrintable(reader));
+    }
+}
+
+void QPCSCReaderWorker::claimCard(const QString &protocol) {
+    LONG rv = SCARD_S_SUCCESS;
+    DWORD proto = SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1;
+    if (protocol == "T=0") {
+        proto = SCARD_PROTOCOL_T0;
+    } else if (protocol == "T=1") {
+        proto = SCARD_PROTOCOL_T1;
+    }
+    if (abandoned()) {
+        return;
+    }
+    warm = false;
+    if (card && (proto & this->protocol)) {
+#ifdef Q_OS_WIN
+        // Exclusive, as connectCard() would do
+        rv = SCard(Reconnect, card, SCARD_SHARE_EXCLUSIVE, this->protocol, SCARD_LEAVE_CARD, &this->protocol);
+        if (rv == SCARD_S_SUCCESS) {
+            mode = SCARD_SHARE_EXCLUSIVE;
+        }
+#else
+        rv = SCard(BeginTransaction, card);
+#endif
+        if (abandoned()) {
+            return;
+        }
+        if (rv == SCARD_S_SUCCESS) {
+            _log("Claimed warm connection to %s", qPrintable(name));
+            startCache();
+            return emit connected(atr, this->protocol == SCARD_PROTOCOL_T0 ? "T=0" : "T=1");
+        }
+    }
+    // Warm up failed, the card was replaced or another protocol is wanted
+    if (card) {
+        SCard(Disconnect, card, SCARD_LEAVE_CARD);
+        card = 0;
+    }
+    mode = SCARD_SHARE_EXCLUSIVE;
+    connectCard(name, protocol);
+}
+
 void QPCSCReaderWorker::disconnectCard() {
     LONG rv = SCARD_S_SUCCESS;
+    if (abandoned()) {
+        return;
+    }
     if (card) {
 #ifndef Q_OS_WIN
         // No transactions on Windows due to the "5 second rule"
@@ -599,6 +1098,14 @@ void QPCSCReaderWorker::disconnectCard() {
         rv = SCard(Disconnect, card, SCARD_RESET_CARD);
         card = 0;
     }
+    delete recorder;
+    recorder = nullptr;
+    if (cache) {
+        QVariantMap stats = ResponseCache::statistics();
+        _log("Response cache: %d hits, %d misses, %d entries", stats.value("hits").toInt(), stats.value("misses").toInt(), stats.value("entries").toInt());
+        delete cache;
+        cache = nullptr;
+    }
     emit disconnected(rv);
 }
 
@@ -614,13 +1121,27 @@ void QPCSCReaderWorker::reconnectCard(const QString &protocol) {
     } else {
         return emit disconnected(SCARD_E_INVALID_PARAMETER);
     }
+    if (abandoned()) {
+        return;
+    }
     // XXX: what to signal and what to do on error ? Needs thinking
-    rv = SCard(Reconnect, card, mode, proto, SCARD_RESET_CARD, &this->protocol);
+    DWORD known = protocol == "*" ? ProtocolCache::lookup(atr) : 0;
+    rv = SCard(Reconnect, card, mode, known ? known : proto, SCARD_RESET_CARD, &this->protocol);
+    if (known && isStaleProtocol(rv) && !dropped.loadAcquire()) {
+        ProtocolCache::forget(atr);
+        rv = SCard(Reconnect, card, mode, proto, SCARD_RESET_CARD, &this->protocol);
+    }
+    if (abandoned()) {
+        return;
+    }
     if (rv != SCARD_S_SUCCESS) {
         return emit disconnected(rv);
     }
 #ifndef Q_OS_WIN
     rv = SCard(BeginTransaction, card);
+    if (abandoned()) {
+        return;
+    }
     if (rv != SCARD_S_SUCCESS) {
         return emit disconnected(rv);
     }
@@ -639,26 +1160,443 @@ void QPCSCReaderWorker::reconnectCard(const QString &protocol) {
     atr.resize(atrlen);
     tmpname.resize(tmplen);
     _log("Current state of %s: %s, protocol %d, atr %s", tmpname.data(), qPrintable(readerStateNames(tmpstate).join(",")), tmpproto, qPrintable(atr.toHex()));
+    if (protocol == "*") {
+        ProtocolCache::store(atr, this->protocol);
+    }
+    this->atr = atr;
 
+    if (recorder) {
+        recorder->reset(atr, this->protocol == SCARD_PROTOCOL_T0 ? "T=0" : "T=1");
+    }
+    if (cache) {
+        cache->reset();
+    }
     return emit reconnected(atr, this->protocol == SCARD_PROTOCOL_T0 ? "T=0" : "T=1");
 }
 
 
-void QPCSCReaderWorker::transmit(const QByteArray &apdu) {
+// A single APDU to the card, recorded if enabled
+LONG QPCSCReaderWorker::exchange(const QByteArray &apdu, QByteArray &response) {
     SCARD_IO_REQUEST req;
-    QByteArray response(4096, 0); // Should be enough
+    response.resize(4096); // Should be enough
     req.dwProtocol = protocol;
     req.cbPciLength = sizeof(req);
     DWORD rlen = response.size();
     _log("SEND %s", qPrintable(apdu.toHex()));
+    QElapsedTimer timer;
+    timer.start();
     LONG err = SCard(Transmit, card, &req, (const unsigned char *)apdu.data(), DWORD(apdu.size()), &req, (unsigned char *)response.data(), &rlen);
     if (err != SCARD_S_SUCCESS) {
         response.resize(0);
+        return err;
+    }
+    response.resize(rlen);
+    _log("RECV %s", qPrintable(response.toHex()));
+    if (recorder) {
+        recorder->exchange(apdu, response, timer.elapsed());
+    }
+    return err;
+}
+
+void QPCSCReaderWorker::transmit(const QByteArray &apdu) {
+    QByteArray response;
+    if (abandoned()) {
+        return;
+    }
+    if (cache) {
+        if (cache->lookup(apdu, response)) {
+            _log("CACHED %s", qPrintable(response.toHex()));
+            return emit received(response);
+        }
+        // Bring the card to the file that the client expects
+        for (const auto &select: cache->sync()) {
+            QByteArray ignored;
+            LONG rv = exchange(select, ignored);
+            if (abandoned()) {
+                return;
+            }
+            if (rv != SCARD_S_SUCCESS) {
+                cache->lost();
+                break;
+            }
+        }
+    }
+    LONG err = exchange(apdu, response);
+    if (abandoned()) {
+        return;
+    }
+    if (err != SCARD_S_SUCCESS) {
         SCard(Disconnect, card, SCARD_RESET_CARD);
         card = 0;
+        delete recorder;
+        recorder = nullptr;
+        if (cache && err == LONG(SCARD_W_RESET_CARD)) {
+            // Somebody else had the card
+            cache->reset();
+        }
+        delete cache;
+        cache = nullptr;
         return emit disconnected(err);
     }
-    response.resize(rlen);
+    if (cache) {
+        cache->update(apdu, response);
+    }
+    emit received(response);
+}
+
+// Identify the card for caching, after connecting
+void QPCSCReaderWorker::startCache() {
+    delete cache;
+    cache = ResponseCache::identify(name, atr, [this] (const QByteArray &apdu, QByteArray &response) {
+        return exchange(apdu, response);
+    });
+}
+
+// Shared access
+static bool parseProtocol(const QString &protocol, DWORD *proto) {
+    if (protocol == "T=0") {
+        *proto = SCARD_PROTOCOL_T0;
+    } else if (protocol == "T=1") {
+        *proto = SCARD_PROTOCOL_T1;
+    } else if (protocol == "*") {
+        *proto = SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// SELECT by AID changes the active applet for everybody
+static bool isAppletSelect(const QByteArray &apdu, const QByteArray &response) {
+    if (apdu.size() < 5 || (unsigned char)apdu.at(1) != 0xA4 || apdu.at(2) != 0x04 || response.size() < 2) {
+        return false;
+    }
+    unsigned char sw1 = (unsigned char)response.at(response.size() - 2);
+    unsigned char sw2 = (unsigned char)response.at(response.size() - 1);
+    return (sw1 == 0x90 && sw2 == 0x00) || sw1 == 0x61;
+}
+
+QPCSCSession::QPCSCSession(QPCSCScheduler *scheduler, const QString &origin): origin(origin), scheduler(scheduler) {
+}
+
+QPCSCSession::~QPCSCSession() {
+    if (scheduler) {
+        scheduler->close(this);
+    }
+}
+
+void QPCSCSession::connectCard(const QString &reader, const QString &protocol) {
+    _log("Opening shared session to %s for %s", qPrintable(reader), qPrintable(origin));
+    if (!scheduler) {
+        return emit disconnected(SCARD_E_NO_SERVICE);
+    }
+    scheduler->open(this, protocol);
+}
+
+void QPCSCSession::transmit(const QByteArray &bytes) {
+    if (!scheduler) {
+        return emit disconnected(SCARD_E_NO_SERVICE);
+    }
+    queue.append({bytes, QString(), false});
+    scheduler->submit(this);
+}
+
+void QPCSCSession::reconnectCard(const QString &protocol) {
+    if (!scheduler) {
+        return emit disconnected(SCARD_E_NO_SERVICE);
+    }
+    queue.append({QByteArray(), protocol, true});
+    scheduler->submit(this);
+}
+
+void QPCSCSession::disconnectCard() {
+    if (scheduler) {
+        scheduler->close(this);
+    }
+    emit disconnected(SCARD_S_SUCCESS);
+}
+
+QPCSCScheduler::QPCSCScheduler(const QString &reader): reader(reader), linger(this) {
+    QSettings settings;
+    quantum = settings.value("sharedQuantum", 8).toInt();
+    linger.setSingleShot(true);
+    linger.setInterval(settings.value("sharedLinger", 30).toInt());
+    connect(&linger, &QTimer::timeout, this, [this] {
+        yield();
+        pump();
+    });
+}
+
+QPCSCScheduler::~QPCSCScheduler() {
+    if (card) {
+        SCard(Disconnect, card, SCARD_RESET_CARD);
+    }
+    if (context) {
+        SCard(ReleaseContext, context);
+    }
+}
+
+LONG QPCSCScheduler::establish(DWORD protocols) {
+    LONG rv = SCARD_S_SUCCESS;
+    if (!context) {
+        rv = SCard(EstablishContext, SCARD_SCOPE_USER, nullptr, nullptr, &context);
+        if (rv != SCARD_S_SUCCESS) {
+            context = 0;
+            return rv;
+        }
+    }
+    bool wildcard = protocols == (SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1);
+    QByteArray cached = wildcard ? currentATR(context, reader) : QByteArray();
+    DWORD known = ProtocolCache::lookup(cached);
+    rv = SCard(Connect, context, reader.toLatin1().data(), SCARD_SHARE_SHARED, known ? known : protocols, &card, &protocol);
+    if (known && isStaleProtocol(rv)) {
+        _log("Connect with cached protocol failed: %s", QtPCSC::errorName(rv));
+        ProtocolCache::forget(cached);
+        rv = SCard(Connect, context, reader.toLatin1().data(), SCARD_SHARE_SHARED, protocols, &card, &protocol);
+    }
+    if (rv != SCARD_S_SUCCESS) {
+        card = 0;
+        return rv;
+    }
+    selected.clear();
+    rv = status();
+    if (rv == SCARD_S_SUCCESS && wildcard) {
+        ProtocolCache::store(atr, protocol);
+    }
+    return rv;
+}
+
+// Get fresh ATR
+LONG QPCSCScheduler::status() {
+    QByteArray tmpname(reader.toLatin1().size() + 2, 0);
+    DWORD tmplen = tmpname.size();
+    DWORD tmpstate = 0;
+    DWORD tmpproto = 0;
+    atr.resize(33);
+    DWORD atrlen = atr.size();
+    LONG rv = SCard(Status, card, tmpname.data(), &tmplen, &tmpstate, &tmpproto, (unsigned char *) atr.data(), &atrlen);
+    atr.resize(rv == SCARD_S_SUCCESS ? int(atrlen) : 0);
+    return rv;
+}
+
+void QPCSCScheduler::open(QPCSCSession *session, const QString &protocol) {
+    DWORD proto = 0;
+    if (!parseProtocol(protocol, &proto)) {
+        return emit session->disconnected(SCARD_E_INVALID_PARAMETER);
+    }
+    if (!card) {
+        LONG rv = establish(proto);
+        if (rv != SCARD_S_SUCCESS) {
+            return emit session->disconnected(rv);
+        }
+        _log("Shared connection to %s, protocol %s", qPrintable(reader), this->protocol == SCARD_PROTOCOL_T0 ? "T=0" : "T=1");
+    } else if (!(proto & this->protocol)) {
+        return emit session->disconnected(SCARD_E_PROTO_MISMATCH);
+    }
+    if (!sessions.contains(session)) {
+        sessions.append(session);
+    }
+    _log("%d sessions on %s", sessions.size(), qPrintable(reader));
+    emit session->connected(atr, this->protocol == SCARD_PROTOCOL_T0 ? "T=0" : "T=1");
+}
+
+void QPCSCScheduler::submit(QPCSCSession *session) {
+    if (!sessions.contains(session)) {
+        session->queue.clear();
+        return emit session->disconnected(SCARD_E_NOT_READY);
+    }
+    if (!ready.contains(session)) {
+        ready.append(session);
+    }
+    pump();
+}
+
+void QPCSCScheduler::close(QPCSCSession *session) {
+    session->queue.clear();
+    sessions.removeAll(session);
+    ready.removeAll(session);
+    if (owner == session) {
+        yield();
+    }
+    // Last one out resets the card, like an exclusive connection would
+    if (sessions.isEmpty()) {
+        if (card) {
+            SCard(Disconnect, card, SCARD_RESET_CARD);
+            card = 0;
+        }
+        selected.clear();
+        lastOrigin.clear();
+        return;
+    }
+    pump();
+}
+
+// Next session to get the card, preferring an origin other than the last one
+QPCSCSession *QPCSCScheduler::next() {
+    for (const auto &s: ready) {
+        if (s->origin != lastOrigin) {
+            return s;
+        }
+    }
+    return ready.isEmpty() ? nullptr : ready.first();
+}
+
+// Run queued work, while the current owner has it and keeps the turn
+void QPCSCScheduler::pump() {
+    while (card) {
+        if (!owner) {
+            QPCSCSession *s = next();
+            if (!s) {
+                return;
+            }
+            LONG rv = SCard(BeginTransaction, card);
+            if (rv == LONG(SCARD_W_RESET_CARD)) {
+                // Somebody else reset the card, the state is gone
+                rv = SCard(Reconnect, card, SCARD_SHARE_SHARED, protocol, SCARD_LEAVE_CARD, &protocol);
+                selected.clear();
+                if (rv == SCARD_S_SUCCESS) {
+                    rv = SCard(BeginTransaction, card);
+                }
+            }
+            if (rv != SCARD_S_SUCCESS) {
+                return fail(rv);
+            }
+            owner = s;
+            served = 0;
+            lastOrigin = s->origin;
+        }
+        if (owner->queue.isEmpty()) {
+            // Wait for the next APDU of the owner, for a while
+            ready.removeAll(owner);
+            if (!linger.isActive()) {
+                linger.start();
+            }
+            return;
+        }
+        // Take turns, if others are waiting
+        int waiting = ready.size() - (ready.contains(owner) ? 1 : 0);
+        if (served >= quantum && waiting > 0) {
+            yield();
+            continue;
+        }
+        linger.stop();
+        QPCSCSession *s = owner;
+        QPCSCSession::Work work = s->queue.takeFirst();
+        LONG rv = perform(work);
+        if (rv != SCARD_S_SUCCESS) {
+            return fail(rv);
+        }
+        served++;
+    }
+}
+
+LONG QPCSCScheduler::perform(QPCSCSession::Work &work) {
+    QPCSCSession *s = owner;
+    if (work.reconnect) {
+        // Resets the card for all sessions
+        DWORD proto = 0;
+        if (!parseProtocol(work.protocol, &proto)) {
+            emit s->disconnected(SCARD_E_INVALID_PARAMETER);
+            return SCARD_S_SUCCESS;
+        }
+        SCard(EndTransaction, card, SCARD_LEAVE_CARD);
+        LONG rv = SCard(Reconnect, card, SCARD_SHARE_SHARED, proto, SCARD_RESET_CARD, &protocol);
+        selected.clear();
+        if (rv == SCARD_S_SUCCESS) {
+            rv = SCard(BeginTransaction, card);
+        }
+        if (rv == SCARD_S_SUCCESS) {
+            rv = status();
+        }
+        if (rv == SCARD_S_SUCCESS) {
+            s->selected.clear();
+            emit s->reconnected(atr, protocol == SCARD_PROTOCOL_T0 ? "T=0" : "T=1");
+        }
+        return rv;
+    }
+
+    // Restore the applet of the session
+    if (!s->selected.isEmpty() && s->selected != selected) {
+        QByteArray response;
+        _log("Selecting the applet of %s again", qPrintable(s->origin));
+        LONG rv = exchange(s->selected, response);
+        if (rv != SCARD_S_SUCCESS) {
+            return rv;
+        }
+        selected = isAppletSelect(s->selected, response) ? s->selected : QByteArray();
+    }
+    QByteArray response;
+    LONG rv = exchange(work.apdu, response);
+    if (rv == LONG(SCARD_W_RESET_CARD)) {
+        // Reset by some other application, try once more
+        rv = SCard(Reconnect, card, SCARD_SHARE_SHARED, protocol, SCARD_LEAVE_CARD, &protocol);
+        selected.clear();
+        if (rv == SCARD_S_SUCCESS && !s->selected.isEmpty()) {
+            QByteArray ignored;
+            rv = exchange(s->selected, ignored);
+        }
+        if (rv == SCARD_S_SUCCESS) {
+            rv = exchange(work.apdu, response);
+        }
+    }
+    if (rv != SCARD_S_SUCCESS) {
+        return rv;
+    }
+    if (isAppletSelect(work.apdu, response)) {
+        s->selected = work.apdu;
+        selected = work.apdu;
+    }
+    emit s->received(response);
+    return SCARD_S_SUCCESS;
+}
+
+LONG QPCSCScheduler::exchange(const QByteArray &apdu, QByteArray &response) {
+    SCARD_IO_REQUEST req;
+    response.resize(4096);
+    req.dwProtocol = protocol;
+    req.cbPciLength = sizeof(req);
+    DWORD rlen = response.size();
+    _log("SEND %s", qPrintable(apdu.toHex()));
+    LONG rv = SCard(Transmit, card, &req, (const unsigned char *)apdu.data(), DWORD(apdu.size()), &req, (unsigned char *)response.data(), &rlen);
+    response.resize(rv == SCARD_S_SUCCESS ? int(rlen) : 0);
     _log("RECV %s", qPrintable(response.toHex()));
-    emit received(QByteArray((const char*)response.data(), int(response.size())));
+    // Writes make the responses cached by exclusive connections stale
+    ResponseCache::sent(reader, apdu);
+    return rv;
+}
+
+// End the turn of the owner
+void QPCSCScheduler::yield() {
+    linger.stop();
+    if (!owner) {
+        return;
+    }
+    if (card) {
+        SCard(EndTransaction, card, SCARD_LEAVE_CARD);
+    }
+    // Back of the line, if it has more to do
+    ready.removeAll(owner);
+    if (!owner->queue.isEmpty()) {
+        ready.append(owner);
+    }
+    owner = nullptr;
+}
+
+// The connection is lost for everybody
+void QPCSCScheduler::fail(LONG err) {
+    _log("Shared connection to %s failed: %s", qPrintable(reader), QtPCSC::errorName(err));
+    linger.stop();
+    owner = nullptr;
+    ready.clear();
+    if (card) {
+        SCard(Disconnect, card, SCARD_LEAVE_CARD);
+        card = 0;
+    }
+    selected.clear();
+    QList<QPCSCSession *> lost;
+    lost.swap(sessions);
+    for (const auto &s: lost) {
+        s->queue.clear();
+        emit s->disconnected(err);
+    }
 }
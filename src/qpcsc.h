@@ -7,19 +7,25 @@
 #include <QThread>
 #include <QMutex>
 #include <QPair>
+#include <QPointer>
+#include <QTimer>
+#include <QElapsedTimer>
+#include <QSettings>
 
 #include "debuglog.h"
 
-#ifdef __APPLE__
-#include <PCSC/winscard.h>
-#include <PCSC/wintypes.h>
-#else
-#undef UNICODE
-#include <winscard.h>
-#endif
+#include "pcscbackend.h"
+#include "pcscrecorder.h"
+#include "responsecache.h"
+#include "hotplug.h"
 
 #include "context.h"
 
+// Not defined by older PC/SC headers
+#ifndef SCARD_E_NO_ACCESS
+#define SCARD_E_NO_ACCESS ((LONG)0x80100027)
+#endif
+
 class QtPCSC;
 
 // Lives in a separate thread because of possibly blocking
@@ -28,14 +34,31 @@ class QPCSCReaderWorker: public QObject {
     Q_OBJECT
 
 public:
-    ~QPCSCReaderWorker();
+    virtual ~QPCSCReaderWorker();
+
+    // Called from main thread by the watchdog, to SCardCancel() a blocking call
+    SCARDCONTEXT getContext() {
+        QMutexLocker locker(&mutex);
+        return context;
+    };
+    // Called from main thread by the watchdog, if the blocking call can not be
+    // cancelled: the worker resets the card and releases the context itself
+    // once the call returns
+    void abandon() {
+        dropped = 1;
+    };
 
 public slots:
     // establish context in thread and connect to reader
-    void connectCard(const QString &reader, const QString &protocol);
-    void transmit(const QByteArray &bytes);
-    void reconnectCard(const QString &protocol);
-    void disconnectCard();
+    virtual void connectCard(const QString &reader, const QString &protocol);
+    virtual void transmit(const QByteArray &bytes);
+    virtual void reconnectCard(const QString &protocol);
+    virtual void disconnectCard();
+
+    // Connect in shared mode and without a transaction, ahead of time
+    void warmCard(const QString &reader);
+    // Take over a warm connection, or connect if there is none
+    void claimCard(const QString &protocol);
 
 signals:
     // When the connection has been established
@@ -48,28 +71,115 @@ signals:
     void received(const QByteArray &bytes);
 
 private:
+    LONG exchange(const QByteArray &apdu, QByteArray &response);
+    void startCache();
+    bool abandoned(); // checked after every blocking call
+
     SCARDCONTEXT context = 0; // Only required on unix
     SCARDHANDLE card = 0;
     DWORD protocol = SCARD_PROTOCOL_UNDEFINED;
     DWORD mode = SCARD_SHARE_EXCLUSIVE;
+    QByteArray atr; // Of the connected card
+    bool warm = false; // Connected by warmCard(), not yet claimed
     QString name;
+    QMutex mutex; // guards context
+    QAtomicInt dropped; // set by abandon()
+    PCSCRecorder *recorder = nullptr; // if sessions are recorded
+    ResponseCache *cache = nullptr; // if responses are cached
+};
+
+class QPCSCScheduler;
+
+// A logical connection to a card, that shares the physical connection of
+// a QPCSCScheduler with other sessions. Lives in the thread of the scheduler.
+class QPCSCSession: public QPCSCReaderWorker {
+    Q_OBJECT
+
+public:
+    QPCSCSession(QPCSCScheduler *scheduler, const QString &origin);
+    ~QPCSCSession();
+
+    const QString origin;
+
+public slots:
+    void connectCard(const QString &reader, const QString &protocol) override;
+    void transmit(const QByteArray &bytes) override;
+    void reconnectCard(const QString &protocol) override;
+    void disconnectCard() override;
+
+private:
+    friend class QPCSCScheduler;
+
+    struct Work {
+        QByteArray apdu;
+        QString protocol; // for reconnect
+        bool reconnect;
+    };
+
+    QPointer<QPCSCScheduler> scheduler;
+    QList<Work> queue; // Waiting for the turn of the session
+    QByteArray selected; // Last successful SELECT by AID of the session
+};
+
+// Multiplexes one connection in shared mode between several sessions.
+// Sessions get the card in turns, for a batch of APDU-s inside a short
+// transaction, alternating between origins. The applet that a session has
+// selected is selected again before its turn, if another session selected
+// something else in the meantime. Other card state (like verified PIN-s)
+// is shared by all sessions.
+class QPCSCScheduler: public QObject {
+    Q_OBJECT
+
+public:
+    QPCSCScheduler(const QString &reader);
+    ~QPCSCScheduler();
+
+    // Called by the sessions, in the thread of the scheduler
+    void open(QPCSCSession *session, const QString &protocol);
+    void submit(QPCSCSession *session);
+    void close(QPCSCSession *session);
+
+private:
+    LONG establish(DWORD protocols);
+    LONG status();
+    LONG exchange(const QByteArray &apdu, QByteArray &response);
+    LONG perform(QPCSCSession::Work &work);
+    QPCSCSession *next();
+    void pump();
+    void yield();
+    void fail(LONG err);
+
+    QString reader;
+    SCARDCONTEXT context = 0;
+    SCARDHANDLE card = 0;
+    DWORD protocol = SCARD_PROTOCOL_UNDEFINED;
+    QByteArray atr;
+
+    QList<QPCSCSession *> sessions; // Connected sessions
+    QList<QPCSCSession *> ready; // Sessions with queued work, in order of arrival
+    QPCSCSession *owner = nullptr; // The session that has the transaction
+    QString lastOrigin; // Origin of the last turn
+    QByteArray selected; // Applet currently selected on the card
+    int served = 0; // APDU-s in the current turn
+    int quantum; // APDU-s in a turn, if others are waiting
+    QTimer linger; // How long to wait for the next APDU of the owner
 };
 
 // Represents a connection to a reader and a card.
 // It lives in main thread but has a worker thread
+// Every command to the worker is guarded by a deadline. If the worker
+// does not answer in time, the blocking call is cancelled and the reader
+// is abandoned, without waiting for the worker thread.
 class QPCSCReader: public QObject {
     Q_OBJECT
 public:
-    QPCSCReader(WebContext *webcontext, QtPCSC *pcsc, const QString &name, const QString &proto): QObject(webcontext), name(name), PCSC(pcsc), protocol(proto) {
-        setObjectName(name);
-    };
+    // With shared set, the card is accessed via the scheduler of the reader
+    QPCSCReader(WebContext *webcontext, QtPCSC *pcsc, const QString &name, const QString &proto, bool shared);
 
-    ~QPCSCReader() {
-        if (thread.isRunning()) {
-            thread.quit();
-            thread.wait();
-        }
-    }
+    ~QPCSCReader();
+
+    // Use a warm worker from QtPCSC, before open()
+    void adopt(QThread *thread, QPCSCReaderWorker *worker);
 
     bool isConnected() {
         return isOpen;
@@ -85,12 +195,17 @@ public slots:
     void cardInserted(const QString &reader, const QByteArray &atr, const QStringList &flags);
     void readerRemoved(const QString &reader);
 
+    // Stop waiting for the worker and report err to the client. A blocking
+    // call is cancelled where PC/SC can, the card is reset only on timeout
+    void abort(const LONG err);
+
 signals:
     // command signals
     void connectCard(const QString &reader, const QString &protocol);
     void reconnectCard(const QString &protocol);
     void disconnectCard();
     void transmitBytes(const QByteArray &bytes);
+    void claimCard(const QString &protocol);
 
     // Proxied signals
     void received(const QByteArray &apdu);
@@ -99,11 +214,18 @@ signals:
     void reconnected(const QByteArray &atr, const QString &protocol);
 
 private:
+    void arm(const QString &operation, int msec);
+    void expired();
+
     bool isOpen = false;
+    bool adopted = false; // The worker was warmed up by QtPCSC
     QtPCSC *PCSC;
     QString protocol;
-    QThread thread;
-    QPCSCReaderWorker worker;
+    // Owned, but released from the worker thread if it is still blocked.
+    // Shared readers have a session instead and no thread of their own
+    QThread *thread;
+    QPCSCReaderWorker *worker;
+    QTimer deadline; // watchdog for the currently running worker command
 };
 
 
@@ -126,6 +248,18 @@ public slots:
 #endif
     QMap<QString, QPair<QByteArray, QStringList>> getReaders();
 
+    bool hasPnP() {
+        QMutexLocker locker(&mutex);
+        return pnp;
+    };
+    // Called from main thread, to list readers again without waiting for PnP
+    void wake();
+    // Called from main thread before cancel() on exit, only then is
+    // SCARD_E_CANCELLED not a wake-up
+    void stop() {
+        stopping = 1;
+    };
+
 signals:
     void stopped(LONG rv);
     void started();
@@ -144,6 +278,8 @@ private:
     LONG generate();
     SCARDCONTEXT context = 0;
     bool pnp = true;
+    QAtomicInt relist; // Set by wake()
+    QAtomicInt stopping; // Set by stop()
     const char *pnpReaderName = "\\\\?PnP?\\Notification";
     QMap<QString, QPair<QByteArray, DWORD>> known; // Known readers
     QMutex mutex; // Lock that guards the known readers
@@ -158,7 +294,9 @@ class QtPCSC: public QObject {
     Q_OBJECT
 
 public:
-    QtPCSC() {
+    QtPCSC(): monitor([this] (const QString &action, const QString &device) {
+        hotplug(action, device);
+    }) {
         thread.start();
         worker.moveToThread(&thread);
         connect(&worker, &QPCSCEventWorker::stopped, this, [this] (LONG rv) {
@@ -169,13 +307,28 @@ public:
             running = true;
             _log("PCSC started");
         }, Qt::QueuedConnection);
-        connect(&worker, &QPCSCEventWorker::cardInserted, this, &QtPCSC::cardInserted, Qt::QueuedConnection);
-        connect(&worker, &QPCSCEventWorker::cardRemoved, this, &QtPCSC::cardRemoved, Qt::QueuedConnection);
-        connect(&worker, &QPCSCEventWorker::readerAttached, this, &QtPCSC::readerAttached, Qt::QueuedConnection);
-        connect(&worker, &QPCSCEventWorker::readerRemoved, this, &QtPCSC::readerRemoved, Qt::QueuedConnection);
-        connect(&worker, &QPCSCEventWorker::readerChanged, this, &QtPCSC::readerChanged, Qt::QueuedConnection);
-        connect(&worker, &QPCSCEventWorker::readerListChanged, this, &QtPCSC::readerListChanged, Qt::QueuedConnection);
+        // Worker events are coalesced before they are emitted to the rest of the app
+        connect(&worker, &QPCSCEventWorker::cardInserted, this, &QtPCSC::queueCardInserted, Qt::QueuedConnection);
+        connect(&worker, &QPCSCEventWorker::cardRemoved, this, &QtPCSC::queueCardRemoved, Qt::QueuedConnection);
+        connect(&worker, &QPCSCEventWorker::readerAttached, this, &QtPCSC::queueReaderAttached, Qt::QueuedConnection);
+        connect(&worker, &QPCSCEventWorker::readerRemoved, this, &QtPCSC::queueReaderRemoved, Qt::QueuedConnection);
+        connect(&worker, &QPCSCEventWorker::readerChanged, this, &QtPCSC::queueReaderChanged, Qt::QueuedConnection);
+        connect(&worker, &QPCSCEventWorker::readerListChanged, this, &QtPCSC::queueReaderListChanged, Qt::QueuedConnection);
+        coalesce.setSingleShot(true);
+        connect(&coalesce, &QTimer::timeout, this, &QtPCSC::flush);
+        connect(this, &QtPCSC::cardInserted, this, &QtPCSC::warmUp);
+        connect(this, &QtPCSC::cardRemoved, this, &QtPCSC::release);
+        connect(this, &QtPCSC::readerRemoved, this, &QtPCSC::release);
+        connect(this, &QtPCSC::cardRemoved, this, &ResponseCache::cardRemoved);
+        connect(this, &QtPCSC::readerRemoved, this, &ResponseCache::cardRemoved);
         connect(this, &QtPCSC::startSignal, &worker, &QPCSCEventWorker::start, Qt::QueuedConnection);
+        // "off", "observe" (only measure) or "wake"
+        QSettings settings;
+        window = settings.value("pcscEventCoalesce", 50).toInt();
+        QString mode = settings.value("hotplugMonitor", "off").toString();
+        if (mode != "off" && monitor.start(this)) {
+            wakeOnHotplug = mode == "wake";
+        }
         emit startSignal();
     }
 
@@ -183,6 +336,10 @@ public:
 
     QMap<QString, QPair<QByteArray, QStringList>> getReaders();
     QPCSCReader *connectReader(WebContext *webcontext, const QString &reader, const QString &protocol, bool wait);
+    // A session on the shared connection to a reader
+    QPCSCSession *openSession(const QString &reader, const QString &origin);
+    // Gives the warm connection to the reader, if any, to a reader that opens
+    void handOver(QPCSCReader *reader);
 
     static const char *errorName(LONG err);
 
@@ -195,10 +352,23 @@ public:
         }
 #endif
         if (running) {
+            worker.stop();
             cancel();
         }
         thread.quit();
         thread.wait();
+        for (const auto &w: warm) {
+            w.thread->quit();
+            w.thread->wait();
+            delete w.worker;
+            delete w.thread;
+        }
+        // Schedulers are deleted in their threads
+        for (const auto &s: schedulers) {
+            QThread *t = s->thread();
+            t->quit();
+            t->wait();
+        }
     }
 signals:
     void cardInserted(const QString &reader, const QByteArray &atr, const QStringList flags);
@@ -216,9 +386,58 @@ signals:
     void startSignal();
 
 private:
+    // Net change of a reader since the last flush
+    struct Delta {
+        bool knownBefore = false; // Reader was known before the burst
+        bool known = false;
+        bool detached = false; // Reader was removed during the burst
+        bool cardBefore = false; // Card was present before the burst
+        bool card = false;
+        bool cardOut = false; // Card was removed during the burst
+        bool changed = false;
+        QByteArray atr;
+        QStringList flags;
+    };
+
+    Delta &delta(const QString &reader, bool known, bool card);
+    void queueCardInserted(const QString &reader, const QByteArray &atr, const QStringList flags);
+    void queueCardRemoved(const QString &reader);
+    void queueReaderAttached(const QString &name);
+    void queueReaderRemoved(const QString &name);
+    void queueReaderChanged(const QString &reader, const QByteArray &atr, const QStringList flags);
+    void queueReaderListChanged(const QMap<QString, QPair<QByteArray, QStringList>> &readers);
+    void schedule();
+    void flush();
+
+    void warmUp(const QString &reader, const QByteArray &atr, const QStringList &flags);
+    void release(const QString &reader);
+
+    void hotplug(const QString &action, const QString &device);
+
     bool running = false;
     QMap<QString, QPair<QByteArray, DWORD>> known; // Known readers
 
+    QMap<QString, Delta> pending; // Coalesced events, by reader
+    bool listChanged = false;
+    QMap<QString, QPair<QByteArray, QStringList>> lastList; // As last reported by the worker
+    QTimer coalesce;
+    int window = 50; // of coalescing, in ms
+    QElapsedTimer burst; // Since the first event not yet emitted
+
+    QMap<QString, QPCSCScheduler *> schedulers; // Of shared readers, each in its own thread
+
+    // Connections made on card insertion, waiting for SCardConnect
+    struct Warm {
+        QThread *thread;
+        QPCSCReaderWorker *worker;
+        QTimer *expiry;
+    };
+    QMap<QString, Warm> warm;
+
+    HotplugMonitor monitor;
+    bool wakeOnHotplug = false;
+    QElapsedTimer plugged; // Since the last reader was plugged in, for latency
+
     QThread thread;
     QPCSCEventWorker worker;
 };
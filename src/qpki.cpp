@@ -16,8 +16,13 @@
 
 #include <QtConcurrent>
 
+#include <algorithm>
+
+#include <QCryptographicHash>
+#include <QJsonArray>
 #include <QSslCertificate>
 #include <QSslCertificateExtension>
+#include <QSslKey>
 
 
 void QPKIWorker::refreshModule(const QString& module) {
@@ -37,12 +42,13 @@ void QPKIWorker::refreshModule(const QString& module) {
         }
     } else {
         _log("%s is already loaded", qPrintable(module));
+        m = modules[module];
         m->refresh();
         _log("Module refreshed with %d certificates", m->getCerts().size());
     }
 
     // re-get all certificates from this modules
-    QMap<QByteArray, P11Token> certs;
+    QHash<QByteArray, P11Token> certs;
     for (auto& c : m->getCerts()) {
         c.second.module = module.toStdString();
         certs[v2ba(c.first)] = c.second;
@@ -116,15 +122,41 @@ void QPKI::handleCardRemoved(const QString &reader) {
 
 
 
-void QPKI::updateCertificates(const QMap<QByteArray, P11Token> certs) {
+void QPKI::updateCertificates(const QHash<QByteArray, P11Token> certs) {
     // FIXME
     certificates = certs;
+    updateInfo();
     _log("Updated certificates, emitting as well. %d", certificates.size());
-    return emit certificateListChanged(QVector<QByteArray>::fromList(certificates.keys()));
+    return emit certificateListChanged(getCertificates());
 }
 
-QVector<QByteArray> QPKI::getCertificates() {
-    return QVector<QByteArray>::fromList(certificates.keys());
+QVector<QByteArray> QPKI::getCertificates() const {
+    QVector<QByteArray> result = QVector<QByteArray>::fromList(certificates.keys());
+    std::sort(result.begin(), result.end(), [this] (const QByteArray &a, const QByteArray &b) {
+        const CertificateInfo &x = infos[a];
+        const CertificateInfo &y = infos[b];
+        return x.name == y.name ? x.fingerprint < y.fingerprint : x.name < y.name;
+    });
+    return result;
+}
+
+CertificateInfo QPKI::getCertificateInfo(const QByteArray &cert) const {
+    return infos.contains(cert) ? infos.value(cert) : CertificateInfo(cert);
+}
+
+QByteArray QPKI::findCertificate(const QString &handle) const {
+    return handles.value(handle.toLower());
+}
+
+// Parse only the certificates that were not known before
+void QPKI::updateInfo() {
+    QHash<QByteArray, CertificateInfo> updated;
+    handles.clear();
+    for (const auto &c: certificates.keys()) {
+        updated[c] = infos.contains(c) ? infos.value(c) : CertificateInfo(c);
+        handles[updated[c].handle] = c;
+    }
+    infos = updated;
 }
 
 
@@ -162,6 +194,7 @@ void QPKI::refreshCAPI() {
                     certificates.remove(c);
                 }
             }
+            updateInfo();
         }
     });
     wincerts.setFuture(QtConcurrent::run(&QWinCrypt::getCertificates));
@@ -174,10 +207,24 @@ void QPKI::select(const WebContext* context, const CertificatePurpose type) {
     _log("Selecting certificate for %s", qPrintable(context->friendlyOrigin()));
     QSettings settings;
 
+    // A remembered authentication certificate is used without asking
+    if (type == Authentication) {
+        QByteArray cert = findCertificate(settings.value(context->friendlyOrigin() + "/" + "authCertificate").toString());
+        if (!cert.isEmpty() && getCertificateInfo(cert).matches(type) && !getCertificateInfo(cert).isExpired()) {
+            _log("Using remembered certificate %s", qPrintable(getCertificateInfo(cert).name));
+            return emit certificate(context, CKR_OK, cert);
+        }
+    }
+
     // FIXME: force this if any of certificates is PCKS#11
     if (settings.value("ownDialogs", false).toBool() || QSysInfo::productType() != "windows") {
-        QtSelectCertificate* dlg = new QtSelectCertificate(context, type);
+        QtSelectCertificate* dlg = new QtSelectCertificate(context, type, this);
         connect(context, &WebContext::disconnected, dlg, &QDialog::reject);
+        connect(context, &WebContext::cancelled, dlg, [dlg] (const QString &resource) {
+            if (resource == "pki" && dlg->isVisible()) {
+                dlg->reject();
+            }
+        });
         connect(PCSC, &QtPCSC::cardInserted, dlg, &QtSelectCertificate::cardInserted, Qt::QueuedConnection);
         connect(this, &QPKI::certificateListChanged, dlg, &QtSelectCertificate::update);
         connect(this, &QPKI::noDriver, dlg, &QtSelectCertificate::noDriver);
@@ -185,7 +232,7 @@ void QPKI::select(const WebContext* context, const CertificatePurpose type) {
         connect(dlg, &QtSelectCertificate::certificateSelected, this,  [this, context](const QByteArray& cert) {
             return emit certificate(context, CKR_OK, cert);
         });
-        dlg->update(QVector<QByteArray>::fromList(certificates.keys()));
+        dlg->update(getCertificates());
     } else {
 #ifdef Q_OS_WIN
         connect(&winop, &QFutureWatcher<QWinCrypt::ErroredResponse>::finished, this, [this, context] {
@@ -221,6 +268,11 @@ void QPKI::sign(const WebContext *context, const QByteArray &cert, const QByteAr
 #ifndef Q_OS_WIN
     QtPINDialog *dlg = new QtPINDialog(context, cert, certificates[cert], CKR_OK, type);
     connect(context, &WebContext::disconnected, dlg, &QDialog::reject);
+    connect(context, &WebContext::cancelled, dlg, [dlg] (const QString &resource) {
+        if (resource == "pki" && dlg->isVisible()) {
+            dlg->reject();
+        }
+    });
     connect(dlg, &QDialog::rejected, this, [this, context] {
         return emit signature(context, CKR_FUNCTION_CANCELED, 0);
     });
@@ -314,11 +366,64 @@ QByteArray QPKI::authenticate_dtbs(const QSslCertificate &cert, const QString &o
     return dtbs;
 }
 
-// TODO: move this to QtPKI
 bool QPKI::usageMatches(const QByteArray &crt, CertificatePurpose type)
 {
-    QSslCertificate cert(crt, QSsl::Der);
-    bool isCa = true;
+    return CertificateInfo(crt).matches(type);
+}
+
+static QString distinguishedName(const QSslCertificate &cert, bool issuer) {
+    static const QList<QPair<QSslCertificate::SubjectInfo, QString>> attributes = {
+        {QSslCertificate::CommonName, "CN"},
+        {QSslCertificate::SerialNumber, "serialNumber"},
+        {QSslCertificate::OrganizationalUnitName, "OU"},
+        {QSslCertificate::Organization, "O"},
+        {QSslCertificate::LocalityName, "L"},
+        {QSslCertificate::StateOrProvinceName, "ST"},
+        {QSslCertificate::CountryName, "C"},
+    };
+    QStringList result;
+    for (const auto &a: attributes) {
+        for (const auto &v: issuer ? cert.issuerInfo(a.first) : cert.subjectInfo(a.first)) {
+            result.append(a.second + "=" + v);
+        }
+    }
+    return result.join(", ");
+}
+
+CertificateInfo::CertificateInfo(const QByteArray &der)
+{
+    QSslCertificate cert(der, QSsl::Der);
+    if (cert.isNull()) {
+        _log("Could not parse certificate");
+        return;
+    }
+    fingerprint = cert.digest(QCryptographicHash::Sha256);
+    handle = QString(fingerprint.left(16).toHex());
+    subject = distinguishedName(cert, false);
+    issuer = distinguishedName(cert, true);
+    notBefore = cert.effectiveDate();
+    notAfter = cert.expiryDate();
+
+    const QStringList org = cert.subjectInfo(QSslCertificate::Organization);
+    if (!org.isEmpty()) {
+        name += org.at(0) + ": ";
+    }
+    name += cert.subjectInfo(QSslCertificate::CommonName).value(0) + " ";
+
+    switch (cert.publicKey().algorithm()) {
+    case QSsl::Rsa:
+        keyType = "RSA";
+        break;
+    case QSsl::Ec:
+        keyType = "EC";
+        break;
+    case QSsl::Dsa:
+        keyType = "DSA";
+        break;
+    default:
+        keyType = "unknown";
+    }
+
     bool isSSLClient = false;
     bool isNonRepudiation = false;
 
@@ -327,7 +432,7 @@ bool QPKI::usageMatches(const QByteArray &crt, CertificatePurpose type)
 //      _log("ext: %s", ext.name().toStdString().c_str());
         if (ext.name() == "basicConstraints") {
             QVariantMap m = ext.value().toMap();
-            isCa = m.value("ca").toBool();
+            ca = m.value("ca").toBool();
         } else if (ext.oid() == "2.5.29.37") {
             // 2.5.29.37 - extendedKeyUsage
             // XXX: these are not declared stable by Qt.
@@ -359,7 +464,31 @@ bool QPKI::usageMatches(const QByteArray &crt, CertificatePurpose type)
             _log("keyusage: %s", v.toByteArray().toHex().toStdString().c_str());
         }
     }
-    _log("Certificate flags: ca=%d auth=%d nonrepu=%d", isCa, isSSLClient, isNonRepudiation);
-    return !isCa &&
-           ((type & Authentication && isSSLClient) || (type & Signing && isNonRepudiation));
-}
\ No newline at end of file
+    _log("Certificate flags: ca=%d auth=%d nonrepu=%d", ca, isSSLClient, isNonRepudiation);
+    if (isSSLClient) {
+        purposes |= Authentication;
+    }
+    if (isNonRepudiation) {
+        purposes |= Signing;
+    }
+}
+
+QJsonObject CertificateInfo::toJson() const
+{
+    QJsonArray usage;
+    if (!ca && (purposes & Authentication)) {
+        usage.append("authentication");
+    }
+    if (!ca && (purposes & Signing)) {
+        usage.append("signing");
+    }
+    return {{"handle", handle},
+            {"subject", subject},
+            {"issuer", issuer},
+            {"notBefore", notBefore.toUTC().toString(Qt::ISODate)},
+            {"notAfter", notAfter.toUTC().toString(Qt::ISODate)},
+            {"expired", isExpired()},
+            {"keyType", keyType},
+            {"purposes", usage},
+            {"fingerprint", QString(fingerprint.toHex())}};
+}
@@ -9,6 +9,9 @@
 #include <QThread>
 #include <QSslCertificate>
 #include <QFutureWatcher>
+#include <QDateTime>
+#include <QJsonObject>
+#include <QHash>
 
 #include "qwincrypt.h"
 #include "pkcs11module.h"
@@ -23,6 +26,27 @@ PKI keeps track of available certificates
 - keeps track of loaded pkcs11 modules
 */
 
+// Metadata of a certificate, parsed once when the certificate list changes
+struct CertificateInfo {
+    CertificateInfo() {};
+    explicit CertificateInfo(const QByteArray &der);
+
+    QString name; // "Organization: CommonName", as shown in dialogs
+    QString subject;
+    QString issuer;
+    QDateTime notBefore;
+    QDateTime notAfter;
+    QString keyType;
+    bool ca = true;
+    int purposes = UnknownPurpose;
+    QByteArray fingerprint; // SHA-256 of the DER
+    QString handle; // first 16 bytes of the fingerprint in hex, stands for the certificate in messages
+
+    bool isExpired() const { return QDateTime::currentDateTime() >= notAfter; };
+    bool matches(CertificatePurpose type) const { return !ca && (purposes & type); };
+    QJsonObject toJson() const;
+};
+
 // PKIWorker owns PKCS11 modules. CAPI is handled with futures in QPKI
 class QPKIWorker: public QObject {
     Q_OBJECT
@@ -48,7 +72,7 @@ public slots:
 
 signals:
     // If list of available certificates changes after card insertion or removal
-    void refreshed(const QMap<QByteArray, P11Token> certs);
+    void refreshed(const QHash<QByteArray, P11Token> certs);
 
     void loginDone(const CK_RV rv);
     void signDone(const CK_RV rv, const QByteArray &signature);
@@ -57,7 +81,7 @@ signals:
 
 private:
     QMap<QString, PKCS11Module *> modules; // loaded PKCS#11 modules
-    QMap<QByteArray, P11Token> certificates; // from which module a certificate comes
+    QHash<QByteArray, P11Token> certificates; // from which module a certificate comes
 };
 
 
@@ -97,7 +121,12 @@ public:
     static const char *errorName(const CK_RV err);
     static bool usageMatches(const QByteArray &crt, CertificatePurpose type);
 
-    QVector<QByteArray> getCertificates();
+    // In the order of names
+    QVector<QByteArray> getCertificates() const;
+    // Cached metadata, parsed on the fly for unknown certificates
+    CertificateInfo getCertificateInfo(const QByteArray &cert) const;
+    // Empty if no such certificate is known
+    QByteArray findCertificate(const QString &handle) const;
 
     void pause() {
         _log("Pausing PCSC event handling");
@@ -116,7 +145,7 @@ public:
 
     static QByteArray authenticate_dtbs(const QSslCertificate &cert, const QString &origin, const QString &nonce);
 
-    void updateCertificates(const QMap<QByteArray, P11Token> certs);
+    void updateCertificates(const QHash<QByteArray, P11Token> certs);
 
     void handleCardInserted(const QString &reader, const QByteArray &atr);
     void handleCardRemoved(const QString &reader);
@@ -141,6 +170,7 @@ signals:
 private:
     void refresh();
     void refreshCAPI();
+    void updateInfo();
 
 #ifdef Q_OS_WIN
     // Windows operation
@@ -153,5 +183,7 @@ private:
     QtPCSC *PCSC;
     QThread thread;
     QPKIWorker worker;
-    QMap<QByteArray, P11Token> certificates; // FIXME: type?
+    QHash<QByteArray, P11Token> certificates; // FIXME: type?
+    QHash<QByteArray, CertificateInfo> infos; // of certificates
+    QHash<QString, QByteArray> handles; // to certificates
 };
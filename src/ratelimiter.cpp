@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2017 Martin Paljak
+ */
+
+#include "ratelimiter.h"
+
+#include "debuglog.h"
+
+#include <QSet>
+#include <QSettings>
+
+RateLimiter::Kind RateLimiter::kindOf(const QJsonObject &message) {
+    if (message.contains("SCardTransmit")) {
+        return Transmit;
+    }
+    // Not SCardConnect, pages reconnect after every card reset
+    for (const auto &command: {"sign", "certificate", "authenticate"}) {
+        if (message.contains(command)) {
+            return Dialog;
+        }
+    }
+    return Other;
+}
+
+// Settings are read on first use, the app is not set up yet at construction.
+// Rates are not limited unless configured
+void RateLimiter::configure() {
+    QSettings settings;
+    limits[Other] = {0, 0}; // not limited
+    limits[Transmit] = {settings.value("rateLimit/transmit", 0).toDouble(), settings.value("rateBurst/transmit", 1000).toDouble()};
+    limits[Dialog] = {settings.value("rateLimit/dialog", 0).toDouble(), settings.value("rateBurst/dialog", 5).toDouble()};
+    maxConcurrent = settings.value("maxConcurrent", 32).toInt();
+    clock.start();
+}
+
+bool RateLimiter::acquire(const QString &origin, Kind kind) {
+    if (!clock.isValid()) {
+        configure();
+    }
+    if (active.value(origin) >= maxConcurrent) {
+        throttled(origin, "too many concurrent requests");
+        return false;
+    }
+    const qint64 now = clock.elapsed();
+    if (now - pruned >= 60000) {
+        prune(now);
+    }
+    const Limit &limit = limits[kind];
+    if (limit.rate > 0) {
+        const QString key = origin + QLatin1Char(' ') + QString::number(kind);
+        if (!buckets.contains(key)) {
+            buckets[key] = {limit.burst, now, kind, origin};
+        }
+        Bucket &b = buckets[key];
+        b.tokens = qMin(limit.burst, b.tokens + (now - b.updated) * limit.rate / 1000);
+        b.updated = now;
+        if (b.tokens < 1) {
+            throttled(origin, kind == Transmit ? "transmit rate" : "dialog rate");
+            return false;
+        }
+        b.tokens -= 1;
+    }
+    active[origin]++;
+    return true;
+}
+
+// Buckets that have filled up again are no different from new ones. The
+// refusal count of an origin goes when it has no requests and no buckets left
+void RateLimiter::prune(qint64 now) {
+    QSet<QString> busy;
+    for (auto i = buckets.begin(); i != buckets.end();) {
+        const Limit &limit = limits[i->kind];
+        if (i->tokens + (now - i->updated) * limit.rate / 1000 >= limit.burst) {
+            i = buckets.erase(i);
+        } else {
+            busy.insert(i->origin);
+            ++i;
+        }
+    }
+    for (auto i = refused.begin(); i != refused.end();) {
+        if (!busy.contains(i.key()) && !active.contains(i.key())) {
+            i = refused.erase(i);
+        } else {
+            ++i;
+        }
+    }
+    pruned = now;
+}
+
+void RateLimiter::release(const QString &origin, int count) {
+    if (count <= 0 || !active.contains(origin)) {
+        return;
+    }
+    active[origin] -= count;
+    if (active.value(origin) <= 0) {
+        active.remove(origin);
+    }
+}
+
+void RateLimiter::throttled(const QString &origin, const char *reason) {
+    _log("Throttled request of %s: %s (%d so far)", qPrintable(origin), reason, ++refused[origin]);
+}
@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2017 Martin Paljak
+ */
+
+#pragma once
+
+#include <QElapsedTimer>
+#include <QHash>
+#include <QJsonObject>
+#include <QString>
+
+// Limits the requests of every origin, over all of its contexts, so that a
+// misbehaving site can not keep the app busy for other sites. Every origin
+// can have a token bucket for APDU-s ("rateLimit/transmit" per second, bursts
+// of "rateBurst/transmit") and one for signing and authentication
+// ("rateLimit/dialog", "rateBurst/dialog"), rates are off unless set. Every
+// origin has at most "maxConcurrent" unanswered requests. Refused requests are answered with "throttled" and
+// counted. Lives in the main thread.
+class RateLimiter {
+public:
+    enum Kind {
+        Other,
+        Transmit,
+        Dialog
+    };
+    static Kind kindOf(const QJsonObject &message);
+
+    // Takes a token and a slot for a request, false if the request is throttled
+    bool acquire(const QString &origin, Kind kind);
+    // count requests of the origin are answered
+    void release(const QString &origin, int count = 1);
+    // Record a request that was refused for other reasons, like backpressure
+    void throttled(const QString &origin, const char *reason);
+
+private:
+    void configure();
+    void prune(qint64 now);
+
+    struct Bucket {
+        double tokens;
+        qint64 updated;
+        Kind kind;
+        QString origin;
+    };
+    struct Limit {
+        double rate; // tokens per second
+        double burst;
+    };
+
+    Limit limits[3];
+    int maxConcurrent = 0;
+    QHash<QString, Bucket> buckets; // origin and kind, idle ones are pruned
+    qint64 pruned = 0;
+    QHash<QString, int> active; // unanswered requests of origin
+    QHash<QString, int> refused; // throttled requests of origin, pruned with the buckets
+    QElapsedTimer clock;
+};
@@ -0,0 +1,260 @@
+/*
+ * Copyright (C) 2017 Martin Paljak
+ */
+
+#include "responsecache.h"
+
+#include "debuglog.h"
+
+#include <QHash>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QSettings>
+#include <QStringList>
+
+static QMutex mutex; // Guards everything below
+static QHash<QByteArray, QHash<QByteArray, QByteArray>> entries; // identity to key to response
+static QHash<QString, QByteArray> present; // reader to identity of the card in it
+static int hits = 0;
+static int misses = 0;
+static int stores = 0;
+static int invalidations = 0;
+
+static const int maxEntries = 512; // per card
+
+static unsigned char ins(const QByteArray &apdu) {
+    return (unsigned char)apdu.at(1);
+}
+
+static bool isOK(const QByteArray &response) {
+    return response.size() >= 2 && (unsigned char)response.at(response.size() - 2) == 0x90 && response.at(response.size() - 1) == 0x00;
+}
+
+static bool isSelect(const QByteArray &apdu) {
+    return ins(apdu) == 0xA4;
+}
+
+// SELECT that does not depend on the current file: by AID, path from MF or MF itself
+static bool isAbsolute(const QByteArray &select) {
+    unsigned char p1 = (unsigned char)select.at(2);
+    if (p1 == 0x04 || p1 == 0x08) {
+        return true;
+    }
+    return p1 == 0x00 && (select.size() <= 5 || select.mid(5, 2) == QByteArray::fromHex("3F00"));
+}
+
+static bool isRead(const QByteArray &apdu) {
+    switch (ins(apdu)) {
+    case 0xB0: // READ BINARY
+    case 0xB1:
+    case 0xB2: // READ RECORD
+    case 0xB3:
+    case 0xCA: // GET DATA
+    case 0xCB:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool isSecurity(const QByteArray &apdu) {
+    switch (ins(apdu)) {
+    case 0x20: // VERIFY
+    case 0x22: // MANAGE SECURITY ENVIRONMENT
+    case 0x24: // CHANGE REFERENCE DATA
+    case 0x2A: // PERFORM SECURITY OPERATION
+    case 0x2C: // RESET RETRY COUNTER
+    case 0x82: // EXTERNAL AUTHENTICATE
+    case 0x84: // GET CHALLENGE
+    case 0x86: // GENERAL AUTHENTICATE
+    case 0x88: // INTERNAL AUTHENTICATE
+        return true;
+    default:
+        // Secure messaging
+        return ((unsigned char)apdu.at(0) & 0x80) == 0 && (apdu.at(0) & 0x0C);
+    }
+}
+
+ResponseCache *ResponseCache::identify(const QString &reader, const QByteArray &atr, Transmit transmit) {
+    QSettings settings;
+    if (!settings.value("responseCache", false).toBool()) {
+        return nullptr;
+    }
+    QStringList apdus = settings.value("responseCacheSerial").toStringList();
+    if (apdus.isEmpty()) {
+        _log("No responseCacheSerial configured, not caching");
+        return nullptr;
+    }
+    QByteArray serial;
+    for (const auto &a: apdus) {
+        QByteArray response;
+        if (transmit(QByteArray::fromHex(a.toLatin1()), response) != SCARD_S_SUCCESS || !isOK(response)) {
+            _log("Could not get serial of card in %s, not caching", qPrintable(reader));
+            return nullptr;
+        }
+        serial = response.left(response.size() - 2);
+    }
+    QByteArray identity = atr.toHex() + ":" + serial.toHex();
+    QMutexLocker locker(&mutex);
+    if (present.contains(reader) && present.value(reader) != identity) {
+        entries.remove(present.value(reader));
+    }
+    present[reader] = identity;
+    _log("Caching responses of %s", identity.constData());
+    return new ResponseCache(reader, identity);
+}
+
+QByteArray ResponseCache::key(const QByteArray &apdu) const {
+    QByteArray result;
+    for (const auto &s: path) {
+        result.append(s.toHex()).append('/');
+    }
+    return result.append(apdu.toHex());
+}
+
+void ResponseCache::navigate(const QByteArray &select) {
+    if (isAbsolute(select)) {
+        path.clear();
+    }
+    path.append(select);
+    // Too deep to keep track of
+    if (path.size() > 16) {
+        known = false;
+        path.clear();
+    }
+}
+
+bool ResponseCache::lookup(const QByteArray &apdu, QByteArray &response) {
+    if (apdu.size() < 4 || !known || !(isSelect(apdu) || isRead(apdu)) || isSecurity(apdu)) {
+        return false;
+    }
+    QByteArray k = key(apdu);
+    QMutexLocker locker(&mutex);
+    const auto &card = entries.value(identity);
+    if (!card.contains(k)) {
+        misses++;
+        return false;
+    }
+    response = card.value(k);
+    hits++;
+    locker.unlock();
+    if (isSelect(apdu)) {
+        // The card follows with sync() when needed
+        navigate(apdu);
+    }
+    return true;
+}
+
+QList<QByteArray> ResponseCache::sync() {
+    if (!known || selected == path) {
+        return QList<QByteArray>();
+    }
+    QList<QByteArray> result;
+    if (path.mid(0, selected.size()) == selected) {
+        result = path.mid(selected.size());
+    } else if (!path.isEmpty() && isAbsolute(path.first())) {
+        result = path;
+    } else {
+        // Can not get back without a reset
+        _log("Can not restore the selected file of the card");
+        known = false;
+        path.clear();
+        selected.clear();
+        return result;
+    }
+    selected = path;
+    return result;
+}
+
+void ResponseCache::lost() {
+    known = false;
+    path.clear();
+    selected.clear();
+}
+
+void ResponseCache::update(const QByteArray &apdu, const QByteArray &response) {
+    if (apdu.size() < 4) {
+        return;
+    }
+    bool store = false;
+    QByteArray k;
+    if (isSecurity(apdu)) {
+        secured = true;
+    } else if (isSelect(apdu)) {
+        if (!known && isAbsolute(apdu)) {
+            known = true;
+        }
+        if (!known) {
+            return;
+        }
+        k = key(apdu);
+        store = isOK(response);
+        if (store || (response.size() >= 2 && (unsigned char)response.at(response.size() - 2) == 0x61)) {
+            navigate(apdu);
+            selected = path;
+        }
+    } else if (isRead(apdu)) {
+        k = key(apdu);
+        store = known && isOK(response);
+    } else if (ins(apdu) != 0xC0) { // GET RESPONSE only completes the previous command
+        return invalidate(apdu);
+    }
+    if (!store || secured) {
+        return;
+    }
+    QMutexLocker locker(&mutex);
+    auto &card = entries[identity];
+    if (card.size() < maxEntries) {
+        card[k] = response;
+        stores++;
+    }
+}
+
+void ResponseCache::invalidate(const QByteArray &apdu) {
+    QMutexLocker locker(&mutex);
+    if (entries.remove(identity)) {
+        invalidations++;
+        _log("%s may change the card, dropped cached responses", qPrintable(apdu.left(4).toHex()));
+    }
+}
+
+void ResponseCache::reset() {
+    path.clear();
+    selected.clear();
+    known = true;
+    secured = false;
+    QMutexLocker locker(&mutex);
+    if (entries.remove(identity)) {
+        invalidations++;
+    }
+}
+
+void ResponseCache::sent(const QString &reader, const QByteArray &apdu) {
+    if (apdu.size() < 4 || isSelect(apdu) || isRead(apdu) || isSecurity(apdu) || ins(apdu) == 0xC0) {
+        return;
+    }
+    QMutexLocker locker(&mutex);
+    if (present.contains(reader) && entries.remove(present.value(reader))) {
+        invalidations++;
+        _log("%s may change the card, dropped cached responses", qPrintable(apdu.left(4).toHex()));
+    }
+}
+
+void ResponseCache::cardRemoved(const QString &reader) {
+    QMutexLocker locker(&mutex);
+    if (present.contains(reader)) {
+        if (entries.remove(present.take(reader))) {
+            invalidations++;
+        }
+    }
+}
+
+QVariantMap ResponseCache::statistics() {
+    QMutexLocker locker(&mutex);
+    int total = 0;
+    for (const auto &card: entries) {
+        total += card.size();
+    }
+    return {{"hits", hits}, {"misses", misses}, {"stores", stores}, {"invalidations", invalidations},
+            {"cards", entries.size()}, {"entries", total}};
+}
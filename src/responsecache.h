@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2017 Martin Paljak
+ */
+
+#pragma once
+
+#include "pcscbackend.h"
+
+#include <QByteArray>
+#include <QList>
+#include <QString>
+#include <QVariantMap>
+
+#include <functional>
+
+/*
+Cache for responses to read-only APDU-s, shared by all connections of the app
+and enabled with the "responseCache" setting.
+
+Entries are keyed by the identity of the card, the SELECT-s that lead to
+the current file and the command itself. The identity is the ATR and the
+response to the "responseCacheSerial" APDU-s (a list of hex strings, sent in
+order, that must not change the selected file, like GET DATA). Cards can not
+be cached without it.
+
+Only READ BINARY, READ RECORD and GET DATA with 9000 are cached. SELECT-s are
+answered from the cache as well, without touching the card. The card is brought
+to the same file with the recorded SELECT-s before the next command that goes
+to the card. Entries of a card are dropped when it is removed or reset, or when
+any other command than a read, SELECT or security command is sent to it, also
+by a connection without a cache (shared sessions report with sent()).
+Nothing is stored after security commands or with secure messaging, until the
+card is reset. The selected file of a new connection is not known, somebody
+else may have left the card anywhere, until the first absolute SELECT.
+
+One instance per connection, used from the thread of the connection.
+*/
+class ResponseCache {
+public:
+    typedef std::function<LONG(const QByteArray &apdu, QByteArray &response)> Transmit;
+
+    // Returns nullptr if caching is disabled or the card can not be identified
+    static ResponseCache *identify(const QString &reader, const QByteArray &atr, Transmit transmit);
+
+    // Answer to apdu without the card, if possible
+    bool lookup(const QByteArray &apdu, QByteArray &response);
+    // SELECT-s to send to the card before the next command
+    QList<QByteArray> sync();
+    // Sending the SELECT-s of sync() failed
+    void lost();
+    // The card answered to apdu
+    void update(const QByteArray &apdu, const QByteArray &response);
+    // The card was reset
+    void reset();
+
+    static void cardRemoved(const QString &reader);
+    // apdu went to the card in reader past the cache
+    static void sent(const QString &reader, const QByteArray &apdu);
+    static QVariantMap statistics();
+
+private:
+    ResponseCache(const QString &reader, const QByteArray &identity): reader(reader), identity(identity) {};
+
+    QByteArray key(const QByteArray &apdu) const;
+    void navigate(const QByteArray &select);
+    void invalidate(const QByteArray &apdu);
+
+    QString reader;
+    QByteArray identity;
+    QList<QByteArray> path; // SELECT-s as seen by the client
+    QList<QByteArray> selected; // SELECT-s as done on the card
+    bool known = false; // The path is known, like after a reset or an absolute SELECT
+    bool secured = false; // Security commands were sent since the reset
+};
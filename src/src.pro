@@ -47,6 +47,17 @@ SOURCES += \
     pkcs11module.cpp \
     main.cpp \
     qpcsc.cpp \
+    pcscbackend.cpp \
+    virtualpcsc.cpp \
+    pcscrecorder.cpp \
+    protocolcache.cpp \
+    responsecache.cpp \
+    hotplug.cpp \
+    framedecoder.cpp \
+    cbor.cpp \
+    ratelimiter.cpp \
+    transport.cpp \
+    capture.cpp \
     qpki.cpp \
     autostart.cpp \
     webextension.cpp \
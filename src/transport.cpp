@@ -0,0 +1,372 @@
+/*
+ * Copyright (C) 2017 Martin Paljak
+ */
+
+#include "transport.h"
+
+#include "debuglog.h"
+#include "apduframe.h"
+#include "cbor.h"
+#include "context.h" // for isSecureOrigin
+
+#include <QCoreApplication>
+#include <QDir>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QNetworkRequest>
+#include <QSettings>
+#include <QStandardPaths>
+#include <QWebSocketCorsAuthenticator>
+
+Transport::Transport(QLocalSocket *client, QObject *parent): QObject(parent), local(true), ls(client) {
+    client->setParent(this);
+    // Messages larger than this are not expected from the bridge
+    QSettings settings;
+    decoder = FrameDecoder(settings.value("maxMessageSize", FrameDecoder::defaultMaxSize).toUInt());
+    // Unread data stays in the socket while the context is paused, so that
+    // the bridge is blocked instead of the app buffering without limit
+    client->setReadBufferSize(64 * 1024);
+    connect(client, &QLocalSocket::readyRead, this, [this] {
+        heard.restart();
+        readLocal();
+    });
+    connect(client, &QLocalSocket::disconnected, this, [this] {
+        _log("Local client disconnected (%s)", qPrintable(localOrigin));
+        emit disconnected();
+        deleteLater();
+    });
+}
+
+Transport::Transport(QWebSocket *client, QObject *parent): QObject(parent), local(false), origin(client->origin()), ws(client) {
+    client->setParent(this);
+    connect(client, &QWebSocket::textMessageReceived, this, [this] (const QString &message) {
+        textReceived(message.toUtf8());
+    });
+    connect(client, &QWebSocket::binaryMessageReceived, this, &Transport::binaryReceived);
+    connect(client, &QWebSocket::pong, this, [this] {
+        heard.restart();
+    });
+    connect(client, &QWebSocket::disconnected, this, [this] {
+        _log("%s disconnected", qPrintable(origin));
+        emit disconnected();
+        deleteLater();
+    });
+}
+
+void Transport::start() {
+    started = true;
+    QSettings settings;
+    int interval = settings.value("keepaliveInterval", 15000).toInt();
+    timeout = settings.value("keepaliveTimeout", 45000).toInt();
+    heard.start();
+    capture = ProtocolCapture::start(local ? "local" : "websocket", origin);
+    if (interval > 0) {
+        connect(&pinger, &QTimer::timeout, this, &Transport::keepalive);
+        pinger.start(interval);
+    }
+    for (const auto &m: early) {
+        if (m.first) {
+            binaryReceived(m.second);
+        } else {
+            textReceived(m.second);
+        }
+    }
+    early.clear();
+    if (ls) {
+        readLocal();
+    }
+}
+
+void Transport::keepalive() {
+    // Bridges that did not say they answer pings would pass them on to the page
+    if (ls && !pings) {
+        return heard.restart();
+    }
+    if (ls && paused) {
+        heard.restart();
+    } else if (heard.elapsed() > timeout) {
+        _log("Reaping %s, not heard from in %lld ms", qPrintable(ls ? localOrigin : origin), heard.elapsed());
+        return terminate();
+    }
+    if (ws) {
+        ws->ping();
+    } else {
+        // Always JSON, answered by the bridge itself
+        ls->write(FrameDecoder::encode("{\"internal\":\"ping\"}"));
+    }
+}
+
+void Transport::setPaused(bool paused) {
+    this->paused = paused;
+    if (!paused && ls) {
+        readLocal();
+    }
+}
+
+// Pipelined messages from the local socket are passed on in order, as long
+// as the context is not paused
+void Transport::readLocal() {
+    while (started && !paused && ls->state() == QLocalSocket::ConnectedState) {
+        QByteArray msg;
+        FrameDecoder::Status status = decoder.next(msg);
+        if (status == FrameDecoder::Oversized) {
+            _log("Message too large, terminating");
+            return terminate();
+        }
+        if (status == FrameDecoder::Incomplete) {
+            if (!ls->bytesAvailable()) {
+                return;
+            }
+            _log("Handling %d bytes from local socket", ls->bytesAvailable());
+            if (!decoder.feed(ls->readAll())) {
+                _log("Message too large, terminating");
+                return terminate();
+            }
+            continue;
+        }
+        QByteArray apdu;
+        QJsonObject json = parse(msg, apdu);
+        _log("Read message of %d bytes: %s", msg.size(), cbor ? "CBOR" : msg.constData());
+
+        // Handle internal messages
+        if (json.contains("internal")) {
+            if (json.value("internal").toString() == "quit") {
+                QMetaObject::invokeMethod(QCoreApplication::instance(), "quit", Qt::QueuedConnection);
+                return;
+            }
+            if (json.value("internal").toString() == "pong") {
+                continue;
+            }
+            if (hello(json)) {
+                continue;
+            }
+        }
+        // Check for mandatory fields
+        if (!json.contains("origin") || !json.contains("id")) {
+            _log("No id or origin, terminating");
+            return terminate();
+        }
+
+        // Check origin
+        if (localOrigin.isEmpty()) {
+            localOrigin = json.value("origin").toString();
+        } else if (localOrigin != json.value("origin").toString()) {
+            _log("Origin mismatch, terminating");
+            return terminate();
+        }
+        if (capture) {
+            capture->message(true, withApdu(json, apdu));
+        }
+        emit received(json, apdu);
+    }
+}
+
+void Transport::textReceived(const QByteArray &message) {
+    if (!started) {
+        early.append(qMakePair(false, message));
+        return;
+    }
+    heard.restart();
+    if (Logger::isEnabled()) {
+        _log("Message received from %s: %s", qPrintable(origin), message.constData());
+    }
+    QByteArray apdu;
+    QJsonObject json = parse(message, apdu);
+    if (hello(json)) {
+        return;
+    }
+    if (!json.contains("id")) {
+        _log("No id, terminating");
+        return terminate();
+    }
+    // Add origin for uniform message processing
+    json["origin"] = origin;
+    if (capture) {
+        capture->message(true, withApdu(json, apdu));
+    }
+    emit received(json, apdu);
+}
+
+void Transport::binaryReceived(const QByteArray &message) {
+    if (!started) {
+        early.append(qMakePair(true, message));
+        return;
+    }
+    heard.restart();
+    if (negotiated && Cbor::isCbor(message)) {
+        _log("CBOR message received from %s", qPrintable(origin));
+        return textReceived(message);
+    }
+    ApduFrame::Header header;
+    QByteArray apdu;
+    if (!ApduFrame::decode(message, header, apdu) || header.command != ApduFrame::Transmit) {
+        _log("Invalid frame, terminating");
+        return terminate();
+    }
+    if (capture) {
+        capture->frame(true, message);
+    }
+    emit frameReceived(header.id, header.reader, apdu);
+}
+
+// JSON, or CBOR once negotiated. The reply goes in the same encoding. The
+// APDU of a CBOR SCardTransmit stays raw in apdu
+QJsonObject Transport::parse(const QByteArray &message, QByteArray &apdu) {
+    cbor = negotiated && Cbor::isCbor(message);
+    return cbor ? Cbor::decode(message, &apdu) : QJsonDocument::fromJson(message).object();
+}
+
+// The log and captures are JSON, with the APDU as base64
+QJsonObject Transport::withApdu(QJsonObject message, const QByteArray &apdu) {
+    if (!apdu.isEmpty()) {
+        QJsonObject params = message.value("SCardTransmit").toObject();
+        params["bytes"] = QString(apdu.toBase64());
+        message["SCardTransmit"] = params;
+    }
+    return message;
+}
+
+// Encoding negotiation, always answered in JSON
+bool Transport::hello(const QJsonObject &message) {
+    if (message.value("internal").toString() != "hello") {
+        return false;
+    }
+    if (ls && message.value("ping").toBool()) {
+        pings = true;
+    }
+    QJsonObject result = {{"internal", "hello"}};
+    QSettings settings;
+    if (Cbor::isSupported() && settings.value("cbor", true).toBool() && message.value("encodings").toArray().contains("cbor")) {
+        result["encoding"] = "cbor";
+        negotiated = true;
+    }
+    cbor = false;
+    send(result);
+    return true;
+}
+
+void Transport::send(const QJsonObject &message, const QByteArray &bytes) {
+    // JSON gets bytes as base64, CBOR raw
+    QJsonObject json = message;
+    if (!bytes.isEmpty() && (!cbor || capture || Logger::isEnabled())) {
+        json["bytes"] = QString(bytes.toBase64());
+    }
+    // Serialized once, the log gets the same bytes
+    QByteArray response = cbor ? Cbor::encode(message, bytes) : QJsonDocument(json).toJson(QJsonDocument::Compact);
+    if (!cbor) {
+        _log("Sending outgoing message: %s", response.constData());
+    } else if (Logger::isEnabled()) {
+        _log("Sending outgoing CBOR message: %s", QJsonDocument(json).toJson(QJsonDocument::Compact).constData());
+    }
+    if (capture) {
+        capture->message(false, json);
+    }
+    if (ls) {
+        ls->write(FrameDecoder::encode(response));
+    } else if (cbor) {
+        ws->sendBinaryMessage(response);
+    } else {
+        ws->sendTextMessage(QString::fromUtf8(response));
+    }
+}
+
+void Transport::sendFrame(quint32 id, quint8 reader, quint8 flags, const QByteArray &payload) {
+    ApduFrame::Header header;
+    header.id = id;
+    header.reader = reader;
+    header.flags = flags;
+    QByteArray frame = ApduFrame::encode(header, payload);
+    if (capture) {
+        capture->frame(false, frame);
+    }
+    ws->sendBinaryMessage(frame);
+}
+
+void Transport::terminate() {
+    if (ws) {
+        ws->abort();
+    } else {
+        ls->abort();
+    }
+}
+
+QString TransportServer::listen() {
+    ws = new QWebSocketServer(QStringLiteral("Web eID"), QWebSocketServer::NonSecureMode, this);
+    ws6 = new QWebSocketServer(QStringLiteral("Web eID"), QWebSocketServer::NonSecureMode, this);
+    ls = new QLocalServer(this);
+    quint16 port = 59735;
+
+    QString serverUrlDescription;
+
+    // We allow websocket connections only from secure origins
+    auto checkOrigin = [] (QWebSocketCorsAuthenticator *authenticator) {
+        authenticator->setAllowed(WebContext::isSecureOrigin(authenticator->origin()));
+    };
+
+    if (ws6->listen(QHostAddress::LocalHostIPv6, port)) {
+        serverUrlDescription = ws6->serverUrl().toString();
+        _log("Server running on %s", qPrintable(serverUrlDescription));
+        connect(ws6, &QWebSocketServer::originAuthenticationRequired, this, checkOrigin);
+        connect(ws6, &QWebSocketServer::newConnection, this, &TransportServer::processConnect);
+    } else {
+        _log("Could not listen on v6 %d", port);
+    }
+
+    if (ws->listen(QHostAddress::LocalHost, port)) {
+        serverUrlDescription = ws->serverUrl().toString();
+        _log("Server running on %s", qPrintable(serverUrlDescription));
+        connect(ws, &QWebSocketServer::originAuthenticationRequired, this, checkOrigin);
+        connect(ws, &QWebSocketServer::newConnection, this, &TransportServer::processConnect);
+    } else {
+        _log("Could not listen on %d", port);
+    }
+
+    // TODO: shared file between app and nm-proxy
+    // Set up local server
+    QString serverName;
+#if defined(Q_OS_MACOS)
+    // /tmp/martin-webeid
+    serverName = QDir("/tmp").filePath(qgetenv("USER") + "-webeid");
+#elif defined(Q_OS_WIN32)
+    // \\.\pipe\Martin_Paljak-webeid
+    serverName = qgetenv("USERNAME").simplified().replace(" ", "_") + "-webeid";
+#elif defined(Q_OS_LINUX)
+    // /run/user/1000/webeid-socket
+    serverName = QDir(QStandardPaths::writableLocation(QStandardPaths::RuntimeLocation)).filePath("webeid-socket");
+#else
+#error "Unsupported platform"
+#endif
+
+    ls->setSocketOptions(QLocalServer::UserAccessOption);
+
+    if (ls->listen(serverName)) {
+        _log("Listening on %s", qPrintable(ls->fullServerName()));
+        connect(ls, &QLocalServer::newConnection, this, &TransportServer::processConnectLocal);
+    }
+    return serverUrlDescription;
+}
+
+void TransportServer::processConnectLocal() {
+    QLocalSocket *socket = ls->nextPendingConnection();
+    _log("New connection to local socket");
+    if (!lsEnabled)
+        return socket->abort();
+    emit connected(new Transport(socket, this));
+}
+
+void TransportServer::processConnect() {
+    QWebSocket *client;
+    if (ws->hasPendingConnections()) {
+        client = ws->nextPendingConnection();
+    } else if (ws6->hasPendingConnections()) {
+        client = ws6->nextPendingConnection();
+    } else {
+        return;
+    }
+    _log("Connection to %s from %s:%d (%s)", qPrintable(client->requestUrl().toString()), qPrintable(client->peerAddress().toString()), client->peerPort(), qPrintable(client->origin()));
+    _log("UA: %s", qPrintable(client->request().header(QNetworkRequest::UserAgentHeader).toString()));
+    if (!wsEnabled) {
+        return client->close(QWebSocketProtocol::CloseCodePolicyViolated);
+    }
+    emit connected(new Transport(client, this));
+}
@@ -0,0 +1,122 @@
+/*
+ * Copyright (C) 2017 Martin Paljak
+ */
+
+#pragma once
+
+#include "framedecoder.h"
+#include "capture.h"
+
+#include <QObject>
+#include <QElapsedTimer>
+#include <QJsonObject>
+#include <QTimer>
+#include <QList>
+#include <QPair>
+#include <QWebSocket>
+#include <QWebSocketServer>
+#include <QLocalSocket>
+#include <QLocalServer>
+
+/*
+Protocol I/O of browser contexts, done in a thread of its own so that reading,
+decoding and encoding messages takes no time from the GUI thread. Requests,
+APDU-s included, are still dispatched by WebContext in the GUI thread and wait
+while it is busy.
+
+Transport owns the socket of one context: it reads the length prefixed
+messages of the local socket, decodes JSON and CBOR, checks the mandatory
+fields and answers encoding negotiation. Binary APDU frames are decoded to
+their header and payload. WebContext, in the GUI thread, gets only complete
+messages and sends its replies with queued signals, which are serialized here.
+
+Dead peers are found with keepalives every "keepaliveInterval" ms: WebSocket
+pings, or internal ping messages that the bridge answers if it said so in its
+hello. A connection that has not been heard from in "keepaliveTimeout" ms is
+reaped, which releases the readers and dialogs of its context. A busy context
+that does not read from the local socket is not reaped, neither is a bridge
+that is not pinged.
+
+TransportServer owns the listening sockets and creates a Transport for every
+new connection, which is then handed to QtHost for a WebContext.
+*/
+class Transport: public QObject {
+    Q_OBJECT
+
+public:
+    Transport(QWebSocket *client, QObject *parent);
+    Transport(QLocalSocket *client, QObject *parent);
+    ~Transport() {
+        delete capture;
+    }
+
+    const bool local;
+    const QString origin; // of the WebSocket, local messages carry their own
+
+public slots:
+    // Deliver messages from now on, WebContext is connected
+    void start();
+    // bytes go as base64 to the "bytes" field of JSON, raw to CBOR
+    void send(const QJsonObject &message, const QByteArray &bytes = QByteArray());
+    void sendFrame(quint32 id, quint8 reader, quint8 flags, const QByteArray &payload);
+    // Stop reading from the local socket while the context is busy
+    void setPaused(bool paused);
+    void terminate();
+
+signals:
+    // apdu is the APDU of a CBOR SCardTransmit, not in message as base64
+    void received(const QJsonObject &message, const QByteArray &apdu);
+    void frameReceived(quint32 id, quint8 reader, const QByteArray &apdu);
+    void disconnected();
+
+private:
+    void readLocal();
+    void keepalive();
+    void textReceived(const QByteArray &message);
+    void binaryReceived(const QByteArray &message);
+    QJsonObject parse(const QByteArray &message, QByteArray &apdu);
+    static QJsonObject withApdu(QJsonObject message, const QByteArray &apdu);
+    bool hello(const QJsonObject &message);
+
+    QWebSocket *ws = nullptr;
+    QLocalSocket *ls = nullptr;
+    FrameDecoder decoder; // for ls
+    QString localOrigin; // of the first local message
+    bool negotiated = false; // CBOR was agreed on in hello
+    bool cbor = false; // The last message was CBOR, so is the reply
+    bool started = false;
+    bool paused = false;
+    QTimer pinger;
+    QElapsedTimer heard; // since the peer was last heard from
+    int timeout = 0;
+    bool pings = false; // The bridge said in hello that it answers pings
+    ProtocolCapture *capture = nullptr; // if traffic is captured
+    QList<QPair<bool, QByteArray>> early; // WebSocket messages before start(), binary or not
+};
+
+class TransportServer: public QObject {
+    Q_OBJECT
+
+public:
+    // Returns the URL of the WebSocket server, for display
+    Q_INVOKABLE QString listen();
+
+public slots:
+    void setWebSocketEnabled(bool enabled) { wsEnabled = enabled; };
+    void setLocalSocketEnabled(bool enabled) { lsEnabled = enabled; };
+
+signals:
+    // Connect to the transport and start() it
+    void connected(Transport *transport);
+
+private:
+    void processConnect();
+    void processConnectLocal();
+
+    QWebSocketServer *ws = nullptr; // IPv4
+    QWebSocketServer *ws6 = nullptr; // IPv6
+    bool wsEnabled = true;
+
+    QLocalServer *ls = nullptr; // localsocket
+    bool lsEnabled = true;
+};
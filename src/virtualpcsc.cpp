@@ -0,0 +1,628 @@
+/*
+ * Copyright (C) 2017 Martin Paljak
+ */
+
+#include "virtualpcsc.h"
+
+#include "debuglog.h"
+
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QMutexLocker>
+#include <QThread>
+
+#include <algorithm>
+#include <climits>
+#include <cstring>
+
+static const char *pnpReaderName = "\\\\?PnP?\\Notification";
+
+static DWORD parseProtocol(const QString &protocol) {
+    return protocol == "T=0" ? DWORD(SCARD_PROTOCOL_T0) : DWORD(SCARD_PROTOCOL_T1);
+}
+
+VirtualPCSCBackend::VirtualPCSCBackend() {
+    clock.start();
+}
+
+bool VirtualPCSCBackend::load(const QString &path) {
+    QFile f(path);
+    if (!f.open(QIODevice::ReadOnly)) {
+        _log("Could not open %s", qPrintable(path));
+        return false;
+    }
+    QJsonParseError error;
+    QJsonDocument script = QJsonDocument::fromJson(f.readAll(), &error);
+    if (!script.isObject()) {
+        _log("Could not parse %s: %s", qPrintable(path), qPrintable(error.errorString()));
+        return false;
+    }
+    return load(script.object());
+}
+
+bool VirtualPCSCBackend::load(const QJsonObject &script) {
+    setLatency(script.value("latency").toInt(0), script.value("connectLatency").toInt(0));
+    for (const auto &r: script.value("readers").toArray()) {
+        QJsonObject reader = r.toObject();
+        attachReader(reader.value("name").toString());
+        if (reader.contains("card")) {
+            insertCard(reader.value("name").toString(), reader.value("card").toObject());
+        }
+    }
+    QMutexLocker locker(&mutex);
+    for (const auto &e: script.value("events").toArray()) {
+        QJsonObject event = e.toObject();
+        events.append({qint64(event.value("at").toDouble()), event});
+    }
+    std::stable_sort(events.begin(), events.end(), [] (const Event &a, const Event &b) {
+        return a.at < b.at;
+    });
+    return true;
+}
+
+VirtualPCSCBackend::Card VirtualPCSCBackend::parseCard(const QJsonObject &card) {
+    Card result;
+    result.atr = QByteArray::fromHex(card.value("atr").toString().toLatin1());
+    result.protocol = parseProtocol(card.value("protocol").toString("T=1"));
+    result.mute = card.value("mute").toBool(false);
+    result.latency = card.value("latency").toInt(-1);
+    QJsonObject responses = card.value("responses").toObject();
+    for (const auto &apdu: responses.keys()) {
+        QByteArray response = QByteArray::fromHex(responses.value(apdu).toString().toLatin1());
+        if (apdu == "*") {
+            result.fallback = response;
+        } else {
+            result.responses[QByteArray::fromHex(apdu.toLatin1())] = response;
+        }
+    }
+    if (result.fallback.isEmpty()) {
+        result.fallback = QByteArray::fromHex("6D00"); // INS not supported
+    }
+    return result;
+}
+
+void VirtualPCSCBackend::attachReader(const QString &name) {
+    QMutexLocker locker(&mutex);
+    if (find(name)) {
+        return;
+    }
+    Reader r;
+    r.name = name;
+    readers.append(r);
+    generation++;
+    changed.wakeAll();
+}
+
+void VirtualPCSCBackend::detachReader(const QString &name) {
+    QMutexLocker locker(&mutex);
+    for (int i = 0; i < readers.size(); i++) {
+        if (readers.at(i).name == name) {
+            readers.removeAt(i);
+            generation++;
+            changed.wakeAll();
+            return;
+        }
+    }
+}
+
+void VirtualPCSCBackend::insertCard(const QString &reader, const QJsonObject &card) {
+    QMutexLocker locker(&mutex);
+    Reader *r = find(reader);
+    if (!r) {
+        return;
+    }
+    r->card = parseCard(card);
+    r->present = true;
+    r->insertions++;
+    reset(*r);
+    changed.wakeAll();
+}
+
+void VirtualPCSCBackend::removeCard(const QString &reader) {
+    QMutexLocker locker(&mutex);
+    Reader *r = find(reader);
+    if (!r || !r->present) {
+        return;
+    }
+    r->present = false;
+    r->insertions++;
+    r->transaction = 0;
+    changed.wakeAll();
+}
+
+void VirtualPCSCBackend::setLatency(int transmit, int connect) {
+    QMutexLocker locker(&mutex);
+    transmitLatency = transmit;
+    connectLatency = connect;
+}
+
+// Called with the lock held
+VirtualPCSCBackend::Reader *VirtualPCSCBackend::find(const QString &name) {
+    for (auto &r: readers) {
+        if (r.name == name) {
+            return &r;
+        }
+    }
+    return nullptr;
+}
+
+// Apply scripted events that are due. Called with the lock held
+void VirtualPCSCBackend::advance() {
+    while (!events.isEmpty() && events.first().at <= clock.elapsed()) {
+        QJsonObject event = events.takeFirst().event;
+        // Scripting interface takes the lock itself
+        mutex.unlock();
+        apply(event);
+        mutex.lock();
+    }
+}
+
+void VirtualPCSCBackend::apply(const QJsonObject &event) {
+    _log("Virtual event: %s", QJsonDocument(event).toJson(QJsonDocument::Compact).constData());
+    if (event.contains("attach")) {
+        attachReader(event.value("attach").toString());
+    } else if (event.contains("detach")) {
+        detachReader(event.value("detach").toString());
+    } else if (event.contains("insert")) {
+        insertCard(event.value("insert").toString(), event.value("card").toObject());
+    } else if (event.contains("remove")) {
+        removeCard(event.value("remove").toString());
+    }
+}
+
+QByteArray VirtualPCSCBackend::respond(Reader &reader, const QByteArray &apdu, int &latency) {
+    (void)latency;
+    return reader.card.responses.value(apdu, reader.card.fallback);
+}
+
+void VirtualPCSCBackend::reset(Reader &reader) {
+    (void)reader;
+}
+
+// Fill in the event state of a reader, return true if it differs from current
+bool VirtualPCSCBackend::report(SCARD_READERSTATE &state) {
+    DWORD event = 0;
+    if (strcmp(state.szReader, pnpReaderName) == 0) {
+        event = generation << 16;
+    } else {
+        const Reader *r = find(QString::fromLatin1(state.szReader));
+        if (!r) {
+            event = SCARD_STATE_UNKNOWN;
+        } else if (r->present) {
+            event = SCARD_STATE_PRESENT | (r->insertions << 16);
+            if (r->exclusive) {
+                event |= SCARD_STATE_EXCLUSIVE;
+            } else if (r->handles > 0) {
+                event |= SCARD_STATE_INUSE;
+            }
+            if (r->card.mute) {
+                event |= SCARD_STATE_MUTE;
+            }
+            DWORD atrlen = std::min(DWORD(r->card.atr.size()), DWORD(sizeof(state.rgbAtr)));
+            memcpy(state.rgbAtr, r->card.atr.constData(), atrlen);
+            state.cbAtr = atrlen;
+        } else {
+            event = SCARD_STATE_EMPTY | (r->insertions << 16);
+            state.cbAtr = 0;
+        }
+    }
+    state.dwEventState = event;
+    if (event != (state.dwCurrentState & ~DWORD(SCARD_STATE_CHANGED))) {
+        state.dwEventState |= SCARD_STATE_CHANGED;
+        return true;
+    }
+    return false;
+}
+
+// Validate a card handle, called with the lock held
+LONG VirtualPCSCBackend::check(SCARDHANDLE card, Reader **reader) {
+    if (!handles.contains(card)) {
+        return SCARD_E_INVALID_HANDLE;
+    }
+    const Handle &h = handles[card];
+    Reader *r = find(h.reader);
+    if (!r) {
+        return SCARD_E_READER_UNAVAILABLE;
+    }
+    if (!r->present || r->insertions != h.insertions) {
+        return SCARD_W_REMOVED_CARD;
+    }
+    *reader = r;
+    return SCARD_S_SUCCESS;
+}
+
+LONG VirtualPCSCBackend::EstablishContext(DWORD scope, LPCVOID reserved1, LPCVOID reserved2, SCARDCONTEXT *context) {
+    (void)scope;
+    (void)reserved1;
+    (void)reserved2;
+    QMutexLocker locker(&mutex);
+    *context = nextContext++;
+    contexts[*context] = Context();
+    return SCARD_S_SUCCESS;
+}
+
+LONG VirtualPCSCBackend::ReleaseContext(SCARDCONTEXT context) {
+    QMutexLocker locker(&mutex);
+    if (!contexts.remove(context)) {
+        return SCARD_E_INVALID_HANDLE;
+    }
+    for (const auto &h: handles.keys()) {
+        if (handles.contains(h) && handles.value(h).context == context) {
+            locker.unlock();
+            Disconnect(h, SCARD_LEAVE_CARD);
+            locker.relock();
+        }
+    }
+    return SCARD_S_SUCCESS;
+}
+
+LONG VirtualPCSCBackend::ListReaders(SCARDCONTEXT context, LPCSTR groups, LPSTR mszReaders, DWORD *size) {
+    (void)groups;
+    QMutexLocker locker(&mutex);
+    if (!contexts.contains(context)) {
+        return SCARD_E_INVALID_HANDLE;
+    }
+    advance();
+    if (readers.isEmpty()) {
+        return SCARD_E_NO_READERS_AVAILABLE;
+    }
+    QByteArray list;
+    for (const auto &r: readers) {
+        list.append(r.name.toLatin1());
+        list.append('\0');
+    }
+    list.append('\0');
+    if (mszReaders == nullptr) {
+        *size = DWORD(list.size());
+        return SCARD_S_SUCCESS;
+    }
+    if (*size < DWORD(list.size())) {
+        *size = DWORD(list.size());
+        return SCARD_E_INSUFFICIENT_BUFFER;
+    }
+    memcpy(mszReaders, list.constData(), list.size());
+    *size = DWORD(list.size());
+    return SCARD_S_SUCCESS;
+}
+
+LONG VirtualPCSCBackend::GetStatusChange(SCARDCONTEXT context, DWORD timeout, SCARD_READERSTATE *states, DWORD count) {
+    QMutexLocker locker(&mutex);
+    if (!contexts.contains(context)) {
+        return SCARD_E_INVALID_HANDLE;
+    }
+    QElapsedTimer waited;
+    waited.start();
+    contexts[context].waiting++;
+    LONG rv = SCARD_E_TIMEOUT;
+    for (;;) {
+        advance();
+        bool change = false;
+        for (DWORD i = 0; i < count; i++) {
+            change |= report(states[i]);
+        }
+        if (change) {
+            rv = SCARD_S_SUCCESS;
+            break;
+        }
+        if (!contexts.contains(context)) {
+            rv = SCARD_E_INVALID_HANDLE;
+            break;
+        }
+        if (contexts[context].cancelled) {
+            rv = SCARD_E_CANCELLED;
+            break;
+        }
+        // Wait until timeout, a change or the next scripted event
+        qint64 left = timeout == INFINITE ? -1 : qint64(timeout) - waited.elapsed();
+        if (timeout != INFINITE && left <= 0) {
+            rv = SCARD_E_TIMEOUT;
+            break;
+        }
+        if (!events.isEmpty()) {
+            qint64 next = std::max(events.first().at - clock.elapsed(), qint64(0));
+            left = left < 0 ? next : std::min(left, next);
+        }
+        changed.wait(&mutex, left < 0 ? ULONG_MAX : (unsigned long)left);
+    }
+    if (contexts.contains(context)) {
+        contexts[context].waiting--;
+        contexts[context].cancelled = false;
+    }
+    return rv;
+}
+
+LONG VirtualPCSCBackend::Cancel(SCARDCONTEXT context) {
+    QMutexLocker locker(&mutex);
+    if (!contexts.contains(context)) {
+        return SCARD_E_INVALID_HANDLE;
+    }
+    // Like pcsc-lite, only a blocking call is cancelled
+    if (contexts[context].waiting > 0) {
+        contexts[context].cancelled = true;
+        changed.wakeAll();
+    }
+    return SCARD_S_SUCCESS;
+}
+
+LONG VirtualPCSCBackend::Connect(SCARDCONTEXT context, LPCSTR reader, DWORD mode, DWORD protocols, SCARDHANDLE *card, DWORD *protocol) {
+    mutex.lock();
+    int latency = connectLatency;
+    mutex.unlock();
+    if (latency > 0) {
+        QThread::msleep(latency);
+    }
+
+    QMutexLocker locker(&mutex);
+    if (!contexts.contains(context)) {
+        return SCARD_E_INVALID_HANDLE;
+    }
+    advance();
+    Reader *r = find(QString::fromLatin1(reader));
+    if (!r) {
+        return SCARD_E_UNKNOWN_READER;
+    }
+    if (!r->present) {
+        return SCARD_E_NO_SMARTCARD;
+    }
+    if (r->card.mute) {
+        return SCARD_W_UNRESPONSIVE_CARD;
+    }
+    if (r->exclusive || (mode == SCARD_SHARE_EXCLUSIVE && r->handles > 0)) {
+        return SCARD_E_SHARING_VIOLATION;
+    }
+    if (!(protocols & r->card.protocol)) {
+        return SCARD_E_PROTO_MISMATCH;
+    }
+    *card = nextHandle++;
+    *protocol = r->card.protocol;
+    handles[*card] = {r->name, context, mode, r->card.protocol, r->insertions};
+    r->handles++;
+    r->exclusive = mode == SCARD_SHARE_EXCLUSIVE;
+    changed.wakeAll();
+    return SCARD_S_SUCCESS;
+}
+
+LONG VirtualPCSCBackend::Reconnect(SCARDHANDLE card, DWORD mode, DWORD protocols, DWORD initialization, DWORD *protocol) {
+    QMutexLocker locker(&mutex);
+    Reader *r = nullptr;
+    LONG rv = check(card, &r);
+    if (rv != SCARD_S_SUCCESS) {
+        return rv;
+    }
+    if (!(protocols & r->card.protocol)) {
+        return SCARD_E_PROTO_MISMATCH;
+    }
+    if (mode == SCARD_SHARE_EXCLUSIVE && r->handles > 1) {
+        return SCARD_E_SHARING_VIOLATION;
+    }
+    handles[card].mode = mode;
+    r->exclusive = mode == SCARD_SHARE_EXCLUSIVE;
+    if (initialization != SCARD_LEAVE_CARD) {
+        reset(*r);
+    }
+    *protocol = r->card.protocol;
+    changed.wakeAll();
+    return SCARD_S_SUCCESS;
+}
+
+LONG VirtualPCSCBackend::Disconnect(SCARDHANDLE card, DWORD disposition) {
+    QMutexLocker locker(&mutex);
+    if (!handles.contains(card)) {
+        return SCARD_E_INVALID_HANDLE;
+    }
+    Handle h = handles.take(card);
+    Reader *r = find(h.reader);
+    if (r) {
+        r->handles--;
+        if (h.mode == SCARD_SHARE_EXCLUSIVE) {
+            r->exclusive = false;
+        }
+        if (r->transaction == card) {
+            r->transaction = 0;
+        }
+        if (r->present && r->insertions == h.insertions && disposition != SCARD_LEAVE_CARD) {
+            reset(*r);
+        }
+    }
+    changed.wakeAll();
+    return SCARD_S_SUCCESS;
+}
+
+LONG VirtualPCSCBackend::BeginTransaction(SCARDHANDLE card) {
+    QMutexLocker locker(&mutex);
+    for (;;) {
+        Reader *r = nullptr;
+        LONG rv = check(card, &r);
+        if (rv != SCARD_S_SUCCESS) {
+            return rv;
+        }
+        if (r->transaction == 0 || r->transaction == card) {
+            r->transaction = card;
+            return SCARD_S_SUCCESS;
+        }
+        changed.wait(&mutex);
+    }
+}
+
+LONG VirtualPCSCBackend::EndTransaction(SCARDHANDLE card, DWORD disposition) {
+    QMutexLocker locker(&mutex);
+    Reader *r = nullptr;
+    LONG rv = check(card, &r);
+    if (rv != SCARD_S_SUCCESS) {
+        return rv;
+    }
+    if (r->transaction != card) {
+        return SCARD_E_NOT_TRANSACTED;
+    }
+    r->transaction = 0;
+    if (disposition != SCARD_LEAVE_CARD) {
+        reset(*r);
+    }
+    changed.wakeAll();
+    return SCARD_S_SUCCESS;
+}
+
+LONG VirtualPCSCBackend::Status(SCARDHANDLE card, LPSTR name, DWORD *namelen, DWORD *state, DWORD *protocol, unsigned char *atr, DWORD *atrlen) {
+    QMutexLocker locker(&mutex);
+    Reader *r = nullptr;
+    LONG rv = check(card, &r);
+    if (rv != SCARD_S_SUCCESS) {
+        return rv;
+    }
+    QByteArray n = r->name.toLatin1();
+    if (*namelen < DWORD(n.size() + 1) || *atrlen < DWORD(r->card.atr.size())) {
+        *namelen = DWORD(n.size() + 1);
+        *atrlen = DWORD(r->card.atr.size());
+        return SCARD_E_INSUFFICIENT_BUFFER;
+    }
+    memcpy(name, n.constData(), n.size() + 1);
+    *namelen = DWORD(n.size() + 1);
+    *state = SCARD_PRESENT | SCARD_POWERED | SCARD_SPECIFIC;
+    *protocol = handles[card].protocol;
+    memcpy(atr, r->card.atr.constData(), r->card.atr.size());
+    *atrlen = DWORD(r->card.atr.size());
+    return SCARD_S_SUCCESS;
+}
+
+LONG VirtualPCSCBackend::Transmit(SCARDHANDLE card, const SCARD_IO_REQUEST *sendpci, const unsigned char *send, DWORD sendlen,
+                                  SCARD_IO_REQUEST *recvpci, unsigned char *recv, DWORD *recvlen) {
+    (void)sendpci;
+    (void)recvpci;
+    QMutexLocker locker(&mutex);
+    Reader *r = nullptr;
+    for (;;) {
+        LONG rv = check(card, &r);
+        if (rv != SCARD_S_SUCCESS) {
+            return rv;
+        }
+        // Wait for a transaction of some other handle to end
+        if (r->transaction == 0 || r->transaction == card) {
+            break;
+        }
+        changed.wait(&mutex);
+    }
+    int latency = r->card.latency >= 0 ? r->card.latency : transmitLatency;
+    QByteArray response = respond(*r, QByteArray((const char *)send, int(sendlen)), latency);
+    if (latency > 0) {
+        locker.unlock();
+        QThread::msleep(latency);
+        locker.relock();
+    }
+    if (*recvlen < DWORD(response.size())) {
+        *recvlen = DWORD(response.size());
+        return SCARD_E_INSUFFICIENT_BUFFER;
+    }
+    memcpy(recv, response.constData(), response.size());
+    *recvlen = DWORD(response.size());
+    return SCARD_S_SUCCESS;
+}
+
+bool ReplayPCSCBackend::replay(const QString &path, bool fast) {
+    this->fast = fast;
+    QFileInfo info(path);
+    if (!info.isDir()) {
+        return add(path);
+    }
+    bool result = false;
+    for (const auto &f: QDir(path).entryInfoList(QStringList() << "*.json", QDir::Files, QDir::Name)) {
+        result |= add(f.filePath());
+    }
+    return result;
+}
+
+bool ReplayPCSCBackend::add(const QString &path) {
+    QFile f(path);
+    if (!f.open(QIODevice::ReadOnly)) {
+        _log("Could not open %s", qPrintable(path));
+        return false;
+    }
+    QJsonObject recorded = QJsonDocument::fromJson(f.readAll()).object();
+    if (!recorded.contains("reader") || !recorded.contains("atr")) {
+        _log("%s is not a recorded session", qPrintable(path));
+        return false;
+    }
+    // Same reader recorded several times gets several readers
+    QString name = recorded.value("reader").toString();
+    for (int i = 2; sessions.contains(name); i++) {
+        name = QStringLiteral("%1 #%2").arg(recorded.value("reader").toString()).arg(i);
+    }
+
+    Session session;
+    for (const auto &v: recorded.value("exchanges").toArray()) {
+        QJsonObject e = v.toObject();
+        session.exchanges.append({QByteArray::fromHex(e.value("apdu").toString().toLatin1()),
+                                  QByteArray::fromHex(e.value("response").toString().toLatin1()),
+                                  e.value("ms").toInt(0), e.value("masked").toBool(false), e.value("reset").toBool(false)});
+    }
+    sessions[name] = session;
+    _log("Replaying %d exchanges from %s as %s", session.exchanges.size(), qPrintable(path), qPrintable(name));
+
+    attachReader(name);
+    QJsonObject card;
+    card["atr"] = recorded.value("atr");
+    card["protocol"] = recorded.value("protocol");
+    insertCard(name, card);
+    return true;
+}
+
+// Masked PIN commands only match by header and length
+bool ReplayPCSCBackend::matches(const Exchange &e, const QByteArray &apdu) {
+    if (e.reset) {
+        return false;
+    }
+    if (e.masked) {
+        return e.apdu.size() == apdu.size() && e.apdu.left(5) == apdu.left(5);
+    }
+    return e.apdu == apdu;
+}
+
+QByteArray ReplayPCSCBackend::respond(Reader &reader, const QByteArray &apdu, int &latency) {
+    if (!sessions.contains(reader.name)) {
+        return VirtualPCSCBackend::respond(reader, apdu, latency);
+    }
+    Session &s = sessions[reader.name];
+    int found = -1;
+    for (int i = s.cursor; i < s.exchanges.size() && found < 0; i++) {
+        if (s.exchanges.at(i).reset) {
+            break; // Do not cross a reset
+        }
+        if (matches(s.exchanges.at(i), apdu)) {
+            found = i;
+        }
+    }
+    for (int i = 0; i < s.exchanges.size() && found < 0; i++) {
+        if (matches(s.exchanges.at(i), apdu)) {
+            found = i;
+        }
+    }
+    if (found < 0) {
+        _log("No recorded response to %s", qPrintable(apdu.toHex()));
+        return reader.card.fallback;
+    }
+    if (found >= s.cursor) {
+        s.cursor = found + 1;
+    }
+    s.used = true;
+    latency = fast ? 0 : s.exchanges.at(found).ms;
+    return s.exchanges.at(found).response;
+}
+
+void ReplayPCSCBackend::reset(Reader &reader) {
+    if (!sessions.contains(reader.name)) {
+        return;
+    }
+    Session &s = sessions[reader.name];
+    // Nothing happened since the previous reset, like after insertion
+    if (!s.used) {
+        return;
+    }
+    s.used = false;
+    int next = s.cursor;
+    while (next < s.exchanges.size() && !s.exchanges.at(next).reset) {
+        next++;
+    }
+    s.cursor = next < s.exchanges.size() ? next + 1 : 0;
+}
@@ -0,0 +1,178 @@
+/*
+ * Copyright (C) 2017 Martin Paljak
+ */
+
+#pragma once
+
+#include "pcscbackend.h"
+
+#include <QByteArray>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QList>
+#include <QMap>
+#include <QMutex>
+#include <QString>
+#include <QStringList>
+#include <QWaitCondition>
+#include <QJsonObject>
+
+/*
+In-process PC/SC implementation with virtual readers and cards, for load
+testing and benchmarking the app without hardware. Readers and cards are
+set up from a JSON script, with hex encoded ATR-s and APDU-s:
+
+{
+  "latency": 5,
+  "readers": [
+    {"name": "Virtual Reader 0", "card": {"atr": "3BFE...", "protocol": "T=1",
+                                          "responses": {"00A4040C...": "9000", "*": "6D00"}}}
+  ],
+  "events": [
+    {"at": 1000, "attach": "Virtual Reader 1"},
+    {"at": 2000, "insert": "Virtual Reader 1", "card": {"atr": "3B..."}},
+    {"at": 5000, "remove": "Virtual Reader 1"},
+    {"at": 6000, "detach": "Virtual Reader 1"}
+  ]
+}
+
+"latency" (global or per card) is added to every transmit, "connectLatency"
+to every connect, in milliseconds. Events happen at the given time after
+the backend was created. The same can be done programmatically from any thread.
+*/
+class VirtualPCSCBackend: public PCSCBackend {
+public:
+    VirtualPCSCBackend();
+
+    bool load(const QString &path);
+    bool load(const QJsonObject &script);
+
+    // Scripting interface
+    void attachReader(const QString &name);
+    void detachReader(const QString &name);
+    void insertCard(const QString &reader, const QJsonObject &card);
+    void removeCard(const QString &reader);
+    void setLatency(int transmit, int connect);
+
+    // PCSCBackend
+    LONG EstablishContext(DWORD scope, LPCVOID reserved1, LPCVOID reserved2, SCARDCONTEXT *context) override;
+    LONG ReleaseContext(SCARDCONTEXT context) override;
+    LONG ListReaders(SCARDCONTEXT context, LPCSTR groups, LPSTR readers, DWORD *size) override;
+    LONG GetStatusChange(SCARDCONTEXT context, DWORD timeout, SCARD_READERSTATE *states, DWORD count) override;
+    LONG Cancel(SCARDCONTEXT context) override;
+
+    LONG Connect(SCARDCONTEXT context, LPCSTR reader, DWORD mode, DWORD protocols, SCARDHANDLE *card, DWORD *protocol) override;
+    LONG Reconnect(SCARDHANDLE card, DWORD mode, DWORD protocols, DWORD initialization, DWORD *protocol) override;
+    LONG Disconnect(SCARDHANDLE card, DWORD disposition) override;
+    LONG BeginTransaction(SCARDHANDLE card) override;
+    LONG EndTransaction(SCARDHANDLE card, DWORD disposition) override;
+    LONG Status(SCARDHANDLE card, LPSTR name, DWORD *namelen, DWORD *state, DWORD *protocol, unsigned char *atr, DWORD *atrlen) override;
+    LONG Transmit(SCARDHANDLE card, const SCARD_IO_REQUEST *sendpci, const unsigned char *send, DWORD sendlen,
+                  SCARD_IO_REQUEST *recvpci, unsigned char *recv, DWORD *recvlen) override;
+
+protected:
+    struct Card {
+        QByteArray atr;
+        DWORD protocol = SCARD_PROTOCOL_T1;
+        bool mute = false;
+        int latency = -1; // -1 means global latency
+        QHash<QByteArray, QByteArray> responses; // APDU to response
+        QByteArray fallback; // Response to unknown APDU-s
+    };
+
+    struct Reader {
+        QString name;
+        bool present = false;
+        Card card;
+        DWORD insertions = 0; // Reported in the high word of the state, like pcsc-lite does
+        int handles = 0;
+        bool exclusive = false;
+        SCARDHANDLE transaction = 0;
+    };
+
+    // Answer to an APDU, called with the lock held. latency is preset
+    // to the latency of the card and can be changed.
+    virtual QByteArray respond(Reader &reader, const QByteArray &apdu, int &latency);
+    // Called with the lock held when the card in a reader is reset
+    virtual void reset(Reader &reader);
+
+    static Card parseCard(const QJsonObject &card);
+
+private:
+    struct Context {
+        int waiting = 0;
+        bool cancelled = false;
+    };
+
+    struct Handle {
+        QString reader;
+        SCARDCONTEXT context;
+        DWORD mode;
+        DWORD protocol;
+        DWORD insertions; // To detect removed or replaced cards
+    };
+
+    struct Event {
+        qint64 at;
+        QJsonObject event;
+    };
+
+    void advance();
+    void apply(const QJsonObject &event);
+    bool report(SCARD_READERSTATE &state);
+    LONG check(SCARDHANDLE card, Reader **reader);
+    Reader *find(const QString &name);
+
+    QMutex mutex; // Guards everything below
+    QWaitCondition changed; // Signalled on any change of state
+
+    QElapsedTimer clock;
+    QList<Event> events; // Pending scripted events, ordered by time
+    QList<Reader> readers;
+    DWORD generation = 0; // Changes of the reader list, for PnP notification
+    QMap<SCARDCONTEXT, Context> contexts;
+    QMap<SCARDHANDLE, Handle> handles;
+    SCARDCONTEXT nextContext = 1;
+    SCARDHANDLE nextHandle = 1;
+    int transmitLatency = 0;
+    int connectLatency = 0;
+};
+
+/*
+Virtual readers with cards that answer APDU-s from sessions recorded by
+PCSCRecorder. Every session becomes a reader with the recorded name. Commands
+are answered in the recorded order, a command that does not match the next
+recorded one is looked up from the whole session. A reset moves on to the
+next recorded reset, or starts over at the end of the session. Recorded
+transmit times are replayed, unless fast is set.
+*/
+class ReplayPCSCBackend: public VirtualPCSCBackend {
+public:
+    // A session file or a folder of them
+    bool replay(const QString &path, bool fast);
+
+protected:
+    QByteArray respond(Reader &reader, const QByteArray &apdu, int &latency) override;
+    void reset(Reader &reader) override;
+
+private:
+    struct Exchange {
+        QByteArray apdu;
+        QByteArray response;
+        int ms;
+        bool masked;
+        bool reset;
+    };
+
+    struct Session {
+        QList<Exchange> exchanges;
+        int cursor = 0;
+        bool used = false; // Answered since the last reset
+    };
+
+    bool add(const QString &path);
+    static bool matches(const Exchange &e, const QByteArray &apdu);
+
+    bool fast = false;
+    QHash<QString, Session> sessions; // Reader name to session, guarded like readers
+};
@@ -0,0 +1,42 @@
+#!/usr/bin/python
+# -*- coding: utf-8 -*-
+#
+# Copyright (C) 2017 Martin Paljak
+
+# Reader attach latency on Linux, with and without the hotplug monitor.
+#
+# Enable debug logging, set hotplugMonitor to "observe" in the settings,
+# restart the app and plug a reader in and out a few times. Then do the
+# same with "wake" and run this script to compare the two.
+
+import os
+import re
+import sys
+
+LINE = re.compile(r"Reader attach latency (\d+) ms \((\w+)\)")
+
+def percentile(values, p):
+    values = sorted(values)
+    return values[min(len(values) - 1, int(round(p / 100.0 * (len(values) - 1))))]
+
+def main():
+    if len(sys.argv) > 1:
+        log = sys.argv[1]
+    else:
+        log = os.path.join(os.path.expanduser("~"), "Desktop", "web-eid.log")
+    samples = {}
+    with open(log) as f:
+        for line in f:
+            m = LINE.search(line)
+            if m:
+                samples.setdefault(m.group(2), []).append(int(m.group(1)))
+    if not samples:
+        print("No attach latencies in %s" % log)
+        sys.exit(1)
+    for mode in sorted(samples):
+        values = samples[mode]
+        print("%-8s n=%-4d min=%-6d p50=%-6d p90=%-6d max=%d" % (mode, len(values), min(values),
+              percentile(values, 50), percentile(values, 90), max(values)))
+
+if __name__ == '__main__':
+    main()
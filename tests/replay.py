@@ -0,0 +1,252 @@
+#!/usr/bin/python
+# -*- coding: utf-8 -*-
+#
+# Copyright (C) 2017 Martin Paljak
+
+# Replays captured protocol traffic against a running app and reports the
+# latency of every command.
+#
+# Set "capture" to true in the settings, use a site as usual and find the
+# capture in web-eid-captures on the desktop. Then replay it over the local
+# socket or a WebSocket, at the recorded pace or as fast as the app answers:
+#
+#   replay.py 20170901-101010123-https_example_com.jsonl
+#   replay.py --websocket ws://localhost:59735 --fast capture.jsonl
+#
+# With --app the app is started for the replay, with a virtual PC/SC script
+# (--virtual) or recorded card sessions (--recorded) instead of real cards.
+
+import base64
+import json
+import optparse
+import os
+import socket
+import struct
+import subprocess
+import sys
+import threading
+import time
+
+META = ("id", "origin", "lang", "browser")
+
+
+def percentile(values, p):
+    values = sorted(values)
+    return values[min(len(values) - 1, int(round(p / 100.0 * (len(values) - 1))))]
+
+
+def local_socket_path():
+    if sys.platform == "darwin":
+        return os.path.join("/tmp", os.environ["USER"] + "-webeid")
+    return os.path.join(os.environ.get("XDG_RUNTIME_DIR", "/run/user/%d" % os.getuid()), "webeid-socket")
+
+
+def recv_exactly(s, n):
+    data = b""
+    while len(data) < n:
+        chunk = s.recv(n - len(data))
+        if not chunk:
+            raise EOFError("connection closed")
+        data += chunk
+    return data
+
+
+class LocalSocket:
+    def __init__(self, path):
+        self.s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self.s.connect(path)
+
+    def send_json(self, message):
+        data = json.dumps(message).encode("utf-8")
+        self.s.sendall(struct.pack("=I", len(data)) + data)
+
+    def send_frame(self, frame):
+        raise ValueError("binary frames need a WebSocket")
+
+    # Returns (True, frame) or (False, message)
+    def receive(self):
+        length = struct.unpack("=I", recv_exactly(self.s, 4))[0]
+        return False, json.loads(recv_exactly(self.s, length).decode("utf-8"))
+
+
+class WebSocket:
+    def __init__(self, url, origin):
+        rest = url.split("://", 1)[1]
+        hostport, _, path = rest.partition("/")
+        host, _, port = hostport.rpartition(":")
+        self.s = socket.create_connection((host.strip("[]"), int(port)))
+        key = base64.b64encode(os.urandom(16)).decode("ascii")
+        request = ("GET /%s HTTP/1.1\r\nHost: %s\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                   "Sec-WebSocket-Key: %s\r\nSec-WebSocket-Version: 13\r\nOrigin: %s\r\n\r\n" % (path, hostport, key, origin))
+        self.s.sendall(request.encode("ascii"))
+        response = b""
+        while b"\r\n\r\n" not in response:
+            response += recv_exactly(self.s, 1)
+        if b" 101 " not in response.split(b"\r\n")[0]:
+            raise IOError("WebSocket handshake failed: %s" % response.split(b"\r\n")[0])
+        self.lock = threading.Lock()
+
+    def send(self, opcode, payload):
+        mask = bytearray(os.urandom(4))
+        header = bytearray([0x80 | opcode])
+        if len(payload) < 126:
+            header.append(0x80 | len(payload))
+        elif len(payload) < 65536:
+            header.append(0x80 | 126)
+            header += struct.pack(">H", len(payload))
+        else:
+            header.append(0x80 | 127)
+            header += struct.pack(">Q", len(payload))
+        masked = bytearray(payload)
+        for i in range(len(masked)):
+            masked[i] ^= mask[i % 4]
+        with self.lock:
+            self.s.sendall(bytes(header + mask + masked))
+
+    def send_json(self, message):
+        self.send(0x1, json.dumps(message).encode("utf-8"))
+
+    def send_frame(self, frame):
+        self.send(0x2, frame)
+
+    def receive(self):
+        while True:
+            b0, b1 = bytearray(recv_exactly(self.s, 2))
+            length = b1 & 0x7F
+            if length == 126:
+                length = struct.unpack(">H", recv_exactly(self.s, 2))[0]
+            elif length == 127:
+                length = struct.unpack(">Q", recv_exactly(self.s, 8))[0]
+            payload = recv_exactly(self.s, length)
+            opcode = b0 & 0x0F
+            if opcode == 0x1:
+                return False, json.loads(payload.decode("utf-8"))
+            elif opcode == 0x2:
+                return True, payload
+            elif opcode == 0x9:
+                self.send(0xA, payload)
+            elif opcode == 0x8:
+                raise EOFError("connection closed")
+
+
+def command_of(message):
+    for k in message:
+        if k not in META:
+            return k
+    return "unknown"
+
+
+class Replay:
+    def __init__(self, connection):
+        self.connection = connection
+        self.sent = {}  # id to (command, time)
+        self.latencies = {}
+        self.errors = {}
+        self.done = threading.Condition()
+
+    def answered(self, id, error):
+        with self.done:
+            if id not in self.sent:
+                return
+            command, started = self.sent.pop(id)
+            self.latencies.setdefault(command, []).append((time.time() - started) * 1000.0)
+            if error:
+                self.errors[command] = self.errors.get(command, 0) + 1
+            self.done.notify_all()
+
+    def receive(self):
+        try:
+            while True:
+                binary, message = self.connection.receive()
+                if binary:
+                    frame = bytearray(message)
+                    self.answered("frame:%d" % struct.unpack(">I", bytes(frame[4:8]))[0], frame[3] & 0x01)
+                elif "id" in message:
+                    self.answered(message["id"], "error" in message)
+        except (EOFError, socket.error):
+            with self.done:
+                self.done.notify_all()
+
+    def run(self, entries, fast, timeout):
+        t = threading.Thread(target=self.receive)
+        t.daemon = True
+        t.start()
+        start = time.time()
+        for e in entries:
+            if not fast:
+                delay = start + e["ms"] / 1000.0 - time.time()
+                if delay > 0:
+                    time.sleep(delay)
+            with self.done:
+                if isinstance(e["in"], dict):
+                    message = e["in"]
+                    self.sent[message["id"]] = (command_of(message), time.time())
+                    self.connection.send_json(message)
+                else:
+                    frame = base64.b64decode(e["in"])
+                    self.sent["frame:%d" % struct.unpack(">I", frame[4:8])[0]] = ("frame", time.time())
+                    self.connection.send_frame(frame)
+        # Wait for the last answers
+        deadline = time.time() + timeout
+        with self.done:
+            while self.sent and time.time() < deadline:
+                self.done.wait(deadline - time.time())
+        return time.time() - start
+
+
+def main():
+    parser = optparse.OptionParser(usage="%prog [options] capture.jsonl")
+    parser.add_option("--websocket", metavar="URL", help="replay over a WebSocket, like ws://localhost:59735")
+    parser.add_option("--socket", metavar="PATH", help="local socket of the app")
+    parser.add_option("--fast", action="store_true", help="do not wait between messages")
+    parser.add_option("--timeout", type="int", default=30, help="seconds to wait for the last answers")
+    parser.add_option("--app", metavar="EXE", help="start the app for the replay")
+    parser.add_option("--virtual", metavar="SCRIPT", help="virtual PC/SC script for the app")
+    parser.add_option("--recorded", metavar="DIR", help="recorded card sessions for the app")
+    options, args = parser.parse_args()
+    if len(args) != 1:
+        parser.error("one capture file expected")
+
+    with open(args[0]) as f:
+        lines = [json.loads(l) for l in f if l.strip()]
+    header, entries = lines[0], [e for e in lines[1:] if "in" in e]
+    origin = header.get("origin", "https://example.com")
+    for e in entries:
+        if isinstance(e["in"], dict) and "origin" in e["in"]:
+            origin = e["in"]["origin"]
+            break
+
+    app = None
+    if options.app:
+        env = dict(os.environ)
+        if options.virtual:
+            env["WEB_EID_VIRTUAL_PCSC"] = options.virtual
+        if options.recorded:
+            env["WEB_EID_REPLAY_PCSC"] = options.recorded
+            if options.fast:
+                env["WEB_EID_REPLAY_FAST"] = "1"
+        app = subprocess.Popen([options.app], env=env)
+        time.sleep(2)
+
+    try:
+        if options.websocket:
+            connection = WebSocket(options.websocket, origin)
+        else:
+            connection = LocalSocket(options.socket or local_socket_path())
+        replay = Replay(connection)
+        elapsed = replay.run(entries, options.fast, options.timeout)
+    finally:
+        if app:
+            app.terminate()
+
+    print("%d messages from %s in %.1f s%s" % (len(entries), args[0], elapsed, " (fast)" if options.fast else ""))
+    for command in sorted(replay.latencies):
+        values = replay.latencies[command]
+        print("%-16s n=%-5d errors=%-4d p50=%-8.1f p90=%-8.1f p99=%-8.1f max=%.1f ms" % (command, len(values),
+              replay.errors.get(command, 0), percentile(values, 50), percentile(values, 90), percentile(values, 99), max(values)))
+    if replay.sent:
+        print("%d messages were not answered" % len(replay.sent))
+        sys.exit(1)
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,52 @@
+# Copyright (C) 2017 Martin Paljak
+
+# PC/SC commands against the virtual readers of tests/virtual-reader.json.
+# The bridge starts the app with the virtual backend, so make sure that the
+# app is not running already. Select "Virtual Reader 0" when asked.
+
+import base64
+import binascii
+import os
+import unittest
+from chrome import ChromeTest
+
+SCRIPT = os.path.join(os.path.dirname(os.path.abspath(__file__)), "virtual-reader.json")
+READER = "Virtual Reader 0"
+ATR = "3BDB960080B1FE451F830012233F536549440F9000F1"
+SELECT = "00A4040C0AA000000077010800070000FE00000100"
+
+def b64(hex):
+  return base64.b64encode(bytearray.fromhex(hex)).decode("ascii")
+
+def unb64(b):
+  return binascii.hexlify(base64.b64decode(b)).decode("ascii").upper()
+
+class TestVirtualPCSC(ChromeTest):
+  def setUp(self):
+      os.environ["WEB_EID_VIRTUAL_PCSC"] = SCRIPT
+      ChromeTest.setUp(self)
+
+  def test_list_readers(self):
+      resp = self.transact({"SCardListReaders": {}})
+      readers = dict((r["name"], r) for r in resp["readers"])
+      self.assertTrue(READER in readers)
+      self.assertTrue(readers[READER]["present"])
+      self.assertEqual(readers[READER]["atr"], b64(ATR))
+
+  def test_transmit(self):
+      self.instruct("Select %s" % READER)
+      resp = self.transact({"SCardConnect": {"protocol": "*", "atrs": [b64(ATR)]}})
+      self.assertEqual(resp["name"], READER)
+      self.assertEqual(resp["protocol"], "T=1")
+      self.assertEqual(resp["atr"], b64(ATR))
+      # The same read-only APDU twice, the second one may come from the cache
+      for x in range(2):
+        resp = self.transact({"SCardTransmit": {"reader": READER, "bytes": b64(SELECT)}})
+        self.assertEqual(unb64(resp["bytes"]), "9000")
+      resp = self.transact({"SCardTransmit": {"reader": READER, "bytes": b64("00B0000000")}})
+      self.assertEqual(unb64(resp["bytes"]), "6D00")
+      self.transact({"SCardDisconnect": {"reader": READER}})
+
+if __name__ == '__main__':
+    # run tests
+    unittest.main()
@@ -1,2 +1,4 @@
 TEMPLATE = subdirs
 SUBDIRS += src/nm-bridge src
+# Microbenchmarks, only with qmake CONFIG+=bench
+CONFIG(bench): SUBDIRS += src/bench